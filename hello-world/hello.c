@@ -1,42 +1,519 @@
-/** 
-* @file hello.c 
-* @author Akshat Sinha 
-* @date 10 Sept 2016 
-* @version 0.1 
-* @brief An introductory "Hello World!" loadable kernel 
-* module (LKM) that can display a message in the /var/log/kern.log 
-* file when the module is loaded and removed. The module can accept 
-* an argument when it is loaded -- the name, which appears in the 
-* kernel log files. 
+/**
+* @file hello.c
+* @author Akshat Sinha
+* @date 10 Sept 2016
+* @version 0.2
+* @brief An introductory "Hello World!" loadable kernel
+* module (LKM), grown into a host for kernel micro-benchmarks.
+* Benchmarks register with kbench_register() (see kbench.h) and
+* are run by writing their name to /sys/kernel/debug/kbench/run.
 */
 #define _GNU_SOURCE             /* Get definition of MSG_EXCEPT */
-#include <linux/module.h>	 /* Needed by all modules */ 
-#include <linux/kernel.h>	 /* Needed for KERN_INFO */ 
-#include <linux/init.h>	 /* Needed for the macros */ 
+#include <linux/module.h>	 /* Needed by all modules */
+#include <linux/kernel.h>	 /* Needed for KERN_INFO */
+#include <linux/init.h>	 /* Needed for the macros */
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/irqflags.h> /* local_irq_save */
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mm.h> /* get_page, vm_mmap */
+#include <linux/mman.h> /* MAP_POPULATE */
+#include <linux/mutex.h>
+#include <linux/preempt.h>
+#include <linux/sched.h>
+#include <linux/sched/task.h> /* get_task_struct */
+#include <linux/semaphore.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/timex.h> /* get_cycles */
+#include <linux/uaccess.h>
 
+#include "kbench.h"
 
-MODULE_LICENSE("GPL"); 
 
-///< The author -- visible when you use modinfo 
-MODULE_AUTHOR("Akshat Sinha"); 
+MODULE_LICENSE("GPL");
 
-///< The description -- see modinfo 
-MODULE_DESCRIPTION("A simple Hello world LKM!"); 
+///< The author -- visible when you use modinfo
+MODULE_AUTHOR("Akshat Sinha");
 
-///< The version of the module 
-MODULE_VERSION("0.1"); 
+///< The description -- see modinfo
+MODULE_DESCRIPTION("Kernel micro-benchmark host");
 
-static int __init hello_start(void) 
-{ 
-	printk(KERN_INFO "Loading hello module...\n"); 
-	printk(KERN_INFO "Hello world\n"); 
-	return 0; 
-} 
+///< The version of the module
+MODULE_VERSION("0.2");
 
-static void __exit hello_end(void) 
-{ 
-	printk(KERN_INFO "Goodbye Mr.\n"); 
-} 
+static unsigned int samples = 16;
+module_param(samples, uint, 0644);
+MODULE_PARM_DESC(samples, "Samples per run, 1 to 1024");
 
-module_init(hello_start); 
-module_exit(hello_end); 
+static const char *const mode_names[KBENCH_MODES_NR] = {
+	[KBENCH_NONE] = "none",
+	[KBENCH_PREEMPT] = "preempt",
+	[KBENCH_IRQ] = "irq",
+};
+
+static LIST_HEAD(benches);
+static DEFINE_MUTEX(benches_lock); /* Also serializes the runs. */
+static struct dentry *debugfs_dir;
+
+int kbench_register(struct kbench *b)
+{
+	struct kbench *other;
+	int ret = 0;
+
+	mutex_lock(&benches_lock);
+	list_for_each_entry(other, &benches, node) {
+		if (!strcmp(other->name, b->name)) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+	memset(&b->result, 0, sizeof(b->result));
+	list_add_tail(&b->node, &benches);
+out:
+	mutex_unlock(&benches_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(kbench_register);
+
+void kbench_unregister(struct kbench *b)
+{
+	mutex_lock(&benches_lock);
+	list_del(&b->node);
+	mutex_unlock(&benches_lock);
+}
+EXPORT_SYMBOL_GPL(kbench_unregister);
+
+/* Called with benches_lock held. */
+static int kbench_run(struct kbench *b, enum kbench_mode mode, u64 iters)
+{
+	struct kbench_result r = { .mode = mode, .iters = iters };
+	unsigned int i, n = clamp(READ_ONCE(samples), 1U, 1024U);
+	unsigned long flags = 0;
+	cycles_t c0, cycles;
+	u64 t0, ns;
+	int ret;
+
+	if (mode != KBENCH_NONE && (b->flags & KBENCH_MAY_SLEEP))
+		return -EINVAL;
+	ret = b->setup ? b->setup(b) : 0;
+	if (ret)
+		return ret;
+	for (i = 0; i < n && !ret; i++) {
+		if (mode >= KBENCH_PREEMPT)
+			preempt_disable();
+		if (mode == KBENCH_IRQ)
+			local_irq_save(flags);
+		t0 = ktime_get_ns();
+		c0 = get_cycles();
+		ret = b->run(b, iters);
+		cycles = get_cycles() - c0;
+		ns = ktime_get_ns() - t0;
+		if (mode == KBENCH_IRQ)
+			local_irq_restore(flags);
+		if (mode >= KBENCH_PREEMPT)
+			preempt_enable();
+		if (!r.samples || ns < r.min_ns)
+			r.min_ns = ns;
+		if (!r.samples || cycles < r.min_cycles)
+			r.min_cycles = cycles;
+		r.total_ns += ns;
+		r.samples++;
+		cond_resched();
+	}
+	if (b->teardown)
+		b->teardown(b);
+	if (!ret)
+		b->result = r;
+	return ret;
+}
+
+/* "<name> [none|preempt|irq] [iters]" */
+static ssize_t run_write(struct file *filp, const char __user *ubuf, size_t len, loff_t *off)
+{
+	char buf[96], name[48], mode_name[16] = "none";
+	unsigned long long iters = 0;
+	struct kbench *b;
+	int mode, ret;
+
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	if (sscanf(buf, "%47s %15s %llu", name, mode_name, &iters) < 1)
+		return -EINVAL;
+	mode = match_string(mode_names, KBENCH_MODES_NR, mode_name);
+	if (mode < 0)
+		return mode;
+
+	mutex_lock(&benches_lock);
+	ret = -ENOENT;
+	list_for_each_entry(b, &benches, node) {
+		if (!strcmp(b->name, name)) {
+			ret = kbench_run(b, mode, iters ? iters : b->iters);
+			break;
+		}
+	}
+	mutex_unlock(&benches_lock);
+	return ret ? ret : len;
+}
+
+static const struct file_operations run_fops = {
+	.owner = THIS_MODULE,
+	.write = run_write,
+};
+
+/* total ns over ops with two decimals. */
+static void show_per_op(struct seq_file *m, u64 total, u64 ops)
+{
+	u64 centi = div64_u64(total * 100, ops);
+
+	seq_printf(m, " %11llu.%02llu", centi / 100, centi % 100);
+}
+
+static int results_show(struct seq_file *m, void *v)
+{
+	struct kbench_result *r;
+	struct kbench *b;
+
+	seq_printf(m, "%-24s %-8s %10s %8s %14s %14s %14s\n", "name", "mode", "iters",
+			"samples", "min_ns/op", "mean_ns/op", "min_cycles/op");
+	mutex_lock(&benches_lock);
+	list_for_each_entry(b, &benches, node) {
+		r = &b->result;
+		if (!r->samples) {
+			seq_printf(m, "%-24s %-8s %10llu %8s %14s %14s %14s\n", b->name,
+					b->flags & KBENCH_MAY_SLEEP ? "none" : "any",
+					b->iters, "-", "-", "-", "-");
+			continue;
+		}
+		seq_printf(m, "%-24s %-8s %10llu %8u", b->name, mode_names[r->mode],
+				r->iters, r->samples);
+		show_per_op(m, r->min_ns, r->iters);
+		show_per_op(m, r->total_ns, r->iters * r->samples);
+		show_per_op(m, r->min_cycles, r->iters);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&benches_lock);
+	return 0;
+}
+
+static int results_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, results_show, NULL);
+}
+
+static const struct file_operations results_fops = {
+	.owner = THIS_MODULE,
+	.open = results_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Built in benchmarks. */
+
+struct copy_bufs {
+	void *src;
+	void *dst;
+	void __user *ubuf;
+};
+
+static int copy_setup(struct kbench *b)
+{
+	struct copy_bufs *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+	if (!c)
+		return -ENOMEM;
+	c->src = kvzalloc(b->arg, GFP_KERNEL);
+	c->dst = kvzalloc(b->arg, GFP_KERNEL);
+	if (!c->src || !c->dst) {
+		kvfree(c->src);
+		kvfree(c->dst);
+		kfree(c);
+		return -ENOMEM;
+	}
+	b->priv = c;
+	return 0;
+}
+
+static void copy_teardown(struct kbench *b)
+{
+	struct copy_bufs *c = b->priv;
+
+	if (c->ubuf)
+		vm_munmap((unsigned long)c->ubuf, PAGE_ALIGN(b->arg));
+	kvfree(c->src);
+	kvfree(c->dst);
+	kfree(c);
+}
+
+static int memcpy_run(struct kbench *b, u64 iters)
+{
+	struct copy_bufs *c = b->priv;
+
+	while (iters--) {
+		memcpy(c->dst, c->src, b->arg);
+		barrier();
+	}
+	return 0;
+}
+
+/* Map, and fault in, a user buffer in the address space of the writer. */
+static int uaccess_setup(struct kbench *b)
+{
+	struct copy_bufs *c;
+	unsigned long addr;
+	int ret;
+
+	ret = copy_setup(b);
+	if (ret)
+		return ret;
+	c = b->priv;
+	addr = vm_mmap(NULL, 0, PAGE_ALIGN(b->arg), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, 0);
+	if (IS_ERR_VALUE(addr)) {
+		copy_teardown(b);
+		return (int)addr;
+	}
+	c->ubuf = (void __user *)addr;
+	return 0;
+}
+
+static int copy_to_user_run(struct kbench *b, u64 iters)
+{
+	struct copy_bufs *c = b->priv;
+
+	while (iters--)
+		if (copy_to_user(c->ubuf, c->src, b->arg))
+			return -EFAULT;
+	return 0;
+}
+
+static int copy_from_user_run(struct kbench *b, u64 iters)
+{
+	struct copy_bufs *c = b->priv;
+
+	while (iters--)
+		if (copy_from_user(c->dst, c->ubuf, b->arg))
+			return -EFAULT;
+	return 0;
+}
+
+static int page_setup(struct kbench *b)
+{
+	b->priv = alloc_page(GFP_KERNEL);
+	return b->priv ? 0 : -ENOMEM;
+}
+
+static void page_teardown(struct kbench *b)
+{
+	__free_page(b->priv);
+}
+
+static int get_put_page_run(struct kbench *b, u64 iters)
+{
+	struct page *page = b->priv;
+
+	while (iters--) {
+		get_page(page);
+		put_page(page);
+	}
+	return 0;
+}
+
+/* GFP_NOWAIT never sleeps, so the allocators can be compared in any mode. */
+static int kmalloc_run(struct kbench *b, u64 iters)
+{
+	void *p;
+
+	while (iters--) {
+		p = kmalloc(b->arg, GFP_NOWAIT);
+		if (!p)
+			return -ENOMEM;
+		kfree(p);
+	}
+	return 0;
+}
+
+static int kmem_cache_setup(struct kbench *b)
+{
+	b->priv = kmem_cache_create("kbench", b->arg, 0, 0, NULL);
+	return b->priv ? 0 : -ENOMEM;
+}
+
+static void kmem_cache_teardown(struct kbench *b)
+{
+	kmem_cache_destroy(b->priv);
+}
+
+static int kmem_cache_run(struct kbench *b, u64 iters)
+{
+	void *p;
+
+	while (iters--) {
+		p = kmem_cache_alloc(b->priv, GFP_NOWAIT);
+		if (!p)
+			return -ENOMEM;
+		kmem_cache_free(b->priv, p);
+	}
+	return 0;
+}
+
+/* Wake ups: every operation wakes a helper thread, which wakes the
+ * benchmark back. */
+struct wake_pair {
+	struct task_struct *task;
+	bool stop;
+	struct completion ping, pong;
+	struct semaphore sem_ping, sem_pong;
+};
+
+static int completion_helper(void *data)
+{
+	struct wake_pair *w = data;
+
+	for (;;) {
+		wait_for_completion(&w->ping);
+		if (READ_ONCE(w->stop))
+			return 0;
+		complete(&w->pong);
+	}
+}
+
+static int semaphore_helper(void *data)
+{
+	struct wake_pair *w = data;
+
+	for (;;) {
+		down(&w->sem_ping);
+		if (READ_ONCE(w->stop))
+			return 0;
+		up(&w->sem_pong);
+	}
+}
+
+static int wake_setup(struct kbench *b, int (*helper)(void *data))
+{
+	struct wake_pair *w = kzalloc(sizeof(*w), GFP_KERNEL);
+
+	if (!w)
+		return -ENOMEM;
+	init_completion(&w->ping);
+	init_completion(&w->pong);
+	sema_init(&w->sem_ping, 0);
+	sema_init(&w->sem_pong, 0);
+	w->task = kthread_run(helper, w, "kbench_wake");
+	if (IS_ERR(w->task)) {
+		kfree(w);
+		return PTR_ERR(w->task);
+	}
+	/* The helper returns on its own, keep its task_struct for kthread_stop. */
+	get_task_struct(w->task);
+	b->priv = w;
+	return 0;
+}
+
+static int completion_setup(struct kbench *b)
+{
+	return wake_setup(b, completion_helper);
+}
+
+static int semaphore_setup(struct kbench *b)
+{
+	return wake_setup(b, semaphore_helper);
+}
+
+static void wake_teardown(struct kbench *b)
+{
+	struct wake_pair *w = b->priv;
+
+	/* Whichever the helper waits on. */
+	WRITE_ONCE(w->stop, true);
+	up(&w->sem_ping);
+	complete(&w->ping);
+	kthread_stop(w->task);
+	put_task_struct(w->task);
+	kfree(w);
+}
+
+static int completion_run(struct kbench *b, u64 iters)
+{
+	struct wake_pair *w = b->priv;
+
+	while (iters--) {
+		complete(&w->ping);
+		wait_for_completion(&w->pong);
+	}
+	return 0;
+}
+
+static int semaphore_run(struct kbench *b, u64 iters)
+{
+	struct wake_pair *w = b->priv;
+
+	while (iters--) {
+		up(&w->sem_ping);
+		down(&w->sem_pong);
+	}
+	return 0;
+}
+
+#define MEMCPY_BENCH(size, n) \
+	{ .name = "memcpy-" #size, .arg = size, .iters = n, .setup = copy_setup, \
+	  .run = memcpy_run, .teardown = copy_teardown }
+
+static struct kbench builtin_benches[] = {
+	MEMCPY_BENCH(64, 100000),
+	MEMCPY_BENCH(4096, 10000),
+	MEMCPY_BENCH(65536, 1000),
+	MEMCPY_BENCH(1048576, 20),
+	{ .name = "copy_to_user-4096", .flags = KBENCH_MAY_SLEEP, .arg = 4096,
+	  .iters = 10000, .setup = uaccess_setup, .run = copy_to_user_run,
+	  .teardown = copy_teardown },
+	{ .name = "copy_from_user-4096", .flags = KBENCH_MAY_SLEEP, .arg = 4096,
+	  .iters = 10000, .setup = uaccess_setup, .run = copy_from_user_run,
+	  .teardown = copy_teardown },
+	{ .name = "get_page-put_page", .iters = 100000, .setup = page_setup,
+	  .run = get_put_page_run, .teardown = page_teardown },
+	{ .name = "kmalloc-256", .arg = 256, .iters = 100000, .run = kmalloc_run },
+	{ .name = "kmem_cache-256", .arg = 256, .iters = 100000,
+	  .setup = kmem_cache_setup, .run = kmem_cache_run,
+	  .teardown = kmem_cache_teardown },
+	{ .name = "completion-wake", .flags = KBENCH_MAY_SLEEP, .iters = 10000,
+	  .setup = completion_setup, .run = completion_run,
+	  .teardown = wake_teardown },
+	{ .name = "semaphore-wake", .flags = KBENCH_MAY_SLEEP, .iters = 10000,
+	  .setup = semaphore_setup, .run = semaphore_run,
+	  .teardown = wake_teardown },
+};
+
+static int __init hello_start(void)
+{
+	int i;
+
+	printk(KERN_INFO "Loading hello module...\n");
+	for (i = 0; i < ARRAY_SIZE(builtin_benches); i++)
+		kbench_register(&builtin_benches[i]);
+	debugfs_dir = debugfs_create_dir("kbench", NULL);
+	debugfs_create_file("run", 0200, debugfs_dir, NULL, &run_fops);
+	debugfs_create_file("results", 0444, debugfs_dir, NULL, &results_fops);
+	printk(KERN_INFO "Hello world, %zu benchmarks in kbench\n", ARRAY_SIZE(builtin_benches));
+	return 0;
+}
+
+static void __exit hello_end(void)
+{
+	int i;
+
+	debugfs_remove_recursive(debugfs_dir);
+	for (i = 0; i < ARRAY_SIZE(builtin_benches); i++)
+		kbench_unregister(&builtin_benches[i]);
+	printk(KERN_INFO "Goodbye Mr.\n");
+}
+
+module_init(hello_start);
+module_exit(hello_end);
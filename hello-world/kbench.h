@@ -0,0 +1,54 @@
+#ifndef KBENCH_H
+#define KBENCH_H
+
+/* Kernel micro-benchmarks hosted by the hello module.
+ *
+ * A benchmark registers a struct kbench. Writing its name to
+ * debugfs/kbench/run runs it for a number of samples, each sample one call
+ * of run() timed as a whole, and debugfs/kbench/results shows the best and
+ * the mean time per operation.
+ **/
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+/* What a sample runs with. */
+enum kbench_mode {
+	KBENCH_NONE,	/* Preemptible, interrupts enabled. */
+	KBENCH_PREEMPT,	/* Preemption disabled. */
+	KBENCH_IRQ,	/* Preemption and local interrupts disabled. */
+	KBENCH_MODES_NR,
+};
+
+#define KBENCH_MAY_SLEEP	0x1 /* run() may sleep, KBENCH_NONE only. */
+
+struct kbench_result {
+	enum kbench_mode mode;
+	u64 iters; /* Operations per sample. */
+	unsigned int samples; /* 0 if never run. */
+	u64 min_ns; /* Of the fastest sample. */
+	u64 total_ns;
+	u64 min_cycles;
+};
+
+struct kbench {
+	const char *name;
+	unsigned int flags;
+	u64 iters; /* Default operations per sample. */
+	unsigned long arg; /* For the callbacks, e.g. a size. */
+	/* Optional, called in the context of the writer of run. */
+	int (*setup)(struct kbench *b);
+	/* Run iters operations. Return: 0 or -errno, which ends the run. */
+	int (*run)(struct kbench *b, u64 iters);
+	void (*teardown)(struct kbench *b);
+	void *priv; /* Between setup and teardown. */
+
+	/* Owned by the host. */
+	struct list_head node;
+	struct kbench_result result;
+};
+
+int kbench_register(struct kbench *b);
+void kbench_unregister(struct kbench *b);
+
+#endif
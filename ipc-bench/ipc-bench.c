@@ -0,0 +1,482 @@
+#define _GNU_SOURCE /* memfd_create, MAP_ANONYMOUS */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uint64_t */
+#include <string.h>
+#include <sched.h> /* sched_yield */
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mmap-module/lkmc_mmap.h" /* LKMC_IOC_ATTACH */
+
+/* Run the same workload over every transport, between a parent and a forked
+ * child:
+ *
+ * - latency: ping-pong of one message, the child echoes it back.
+ * - throughput: the parent streams messages, the child acks the last one.
+ *
+ * Shared memory transports move the bytes through one single producer single
+ * consumer ring per direction, polled, or woken with an eventfd for memfd.
+ **/
+
+enum { RING_SLOTS = 8, CACHELINE = 64, SPINS = 1000 };
+
+#define BYTES_PER_RUN	(256UL << 20)
+#define MAX_MESSAGES	100000UL
+
+static const size_t sizes[] = { 64, 1024, 16384, 262144, 1048576 };
+#define NR_SIZES	(sizeof(sizes) / sizeof(sizes[0]))
+
+struct ring {
+	uint64_t head __attribute__((aligned(CACHELINE))); /* Written by the producer. */
+	uint64_t tail __attribute__((aligned(CACHELINE))); /* Written by the consumer. */
+	char slots[] __attribute__((aligned(CACHELINE)));
+};
+
+/* One direction of a channel. */
+struct pipe_end {
+	int rfd;
+	int wfd;
+	struct ring *ring;
+	int efd; /* Wakes the consumer of ring, -1 to poll. */
+	size_t slot_size;
+};
+
+struct chan {
+	struct pipe_end dir[2]; /* Parent to child, child to parent. */
+	void *shm;
+	size_t shm_size;
+	int shmid;
+};
+
+struct transport {
+	const char *name;
+	/* @return 0, or -1 if not available here */
+	int (*setup)(struct chan *c, size_t max);
+	void (*teardown)(struct chan *c);
+	void (*send)(struct pipe_end *e, const void *buf, size_t len);
+	void (*recv)(struct pipe_end *e, void *buf, size_t len);
+};
+
+static const char *mmap_file = "/proc/lkmc_mmap";
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/* Byte streams: pipes and SOCK_STREAM. */
+static void stream_send(struct pipe_end *e, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(e->wfd, p, len);
+		if (ret < 0)
+			die("write");
+		p += ret;
+		len -= ret;
+	}
+}
+
+static void stream_recv(struct pipe_end *e, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(e->rfd, p, len);
+		if (ret <= 0)
+			die("read");
+		p += ret;
+		len -= ret;
+	}
+}
+
+/* SOCK_SEQPACKET keeps the message boundaries. */
+static void packet_send(struct pipe_end *e, const void *buf, size_t len)
+{
+	if (send(e->wfd, buf, len, 0) != (ssize_t)len)
+		die("send");
+}
+
+static void packet_recv(struct pipe_end *e, void *buf, size_t len)
+{
+	if (recv(e->rfd, buf, len, 0) != (ssize_t)len)
+		die("recv");
+}
+
+static void fds_teardown(struct chan *c)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		close(c->dir[i].rfd);
+		if (c->dir[i].wfd != c->dir[i].rfd)
+			close(c->dir[i].wfd);
+	}
+}
+
+static int pipe_setup(struct chan *c, size_t max)
+{
+	int fds[2], i;
+
+	(void)max;
+	for (i = 0; i < 2; i++) {
+		if (pipe(fds))
+			die("pipe");
+		/* As large as allowed, the default 64 KiB splits big messages. */
+		fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+		c->dir[i].rfd = fds[0];
+		c->dir[i].wfd = fds[1];
+	}
+	return 0;
+}
+
+static int socket_setup(struct chan *c, size_t max, int type)
+{
+	int fds[2], size = 2 * max + 4096, got, i;
+	socklen_t len;
+
+	if (socketpair(AF_UNIX, type, 0, fds))
+		die("socketpair");
+	for (i = 0; i < 2; i++) {
+		setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		/* Capped by net.core.wmem_max: a packet that does not fit the
+		 * send buffer fails with EMSGSIZE, so skip that size. The
+		 * 4 KiB cover what AF_UNIX charges besides the payload. */
+		len = sizeof(got);
+		if (type == SOCK_SEQPACKET &&
+				(getsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &got, &len) ||
+				 (size_t)got < max + 4096)) {
+			close(fds[0]);
+			close(fds[1]);
+			return -1;
+		}
+	}
+	/* dir[0]: parent writes fds[0], child reads fds[1], and back. */
+	c->dir[0].wfd = fds[0];
+	c->dir[0].rfd = fds[1];
+	c->dir[1].wfd = fds[1];
+	c->dir[1].rfd = fds[0];
+	return 0;
+}
+
+static int stream_setup(struct chan *c, size_t max)
+{
+	return socket_setup(c, max, SOCK_STREAM);
+}
+
+static int seqpacket_setup(struct chan *c, size_t max)
+{
+	return socket_setup(c, max, SOCK_SEQPACKET);
+}
+
+static void sockets_teardown(struct chan *c)
+{
+	close(c->dir[0].wfd);
+	close(c->dir[0].rfd);
+}
+
+/* Rings */
+
+static size_t ring_size(size_t slot_size)
+{
+	return sizeof(struct ring) + RING_SLOTS * slot_size;
+}
+
+/* Carve the two rings out of c->shm. */
+static void rings_init(struct chan *c, size_t max)
+{
+	size_t slot_size = (max + CACHELINE - 1) & ~(size_t)(CACHELINE - 1);
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		c->dir[i].ring = (struct ring *)((char *)c->shm + i * ring_size(slot_size));
+		c->dir[i].ring->head = 0;
+		c->dir[i].ring->tail = 0;
+		c->dir[i].slot_size = slot_size;
+		c->dir[i].efd = -1;
+	}
+}
+
+static size_t rings_size(size_t max)
+{
+	return 2 * ring_size((max + CACHELINE - 1) & ~(size_t)(CACHELINE - 1));
+}
+
+static void ring_send(struct pipe_end *e, const void *buf, size_t len)
+{
+	struct ring *r = e->ring;
+	uint64_t head = r->head;
+	unsigned spins = 0;
+
+	while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SLOTS)
+		if (++spins > SPINS)
+			sched_yield();
+	memcpy(r->slots + (head % RING_SLOTS) * e->slot_size, buf, len);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	if (e->efd >= 0 && eventfd_write(e->efd, 1))
+		die("eventfd_write");
+}
+
+static void ring_recv(struct pipe_end *e, void *buf, size_t len)
+{
+	struct ring *r = e->ring;
+	uint64_t tail = r->tail;
+	unsigned spins = 0;
+	eventfd_t v;
+
+	/* A send between the check and the read leaves the counter set, so
+	 * the read does not miss it. Polling yields after a while, in case
+	 * the producer waits for this CPU. */
+	while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+		if (e->efd >= 0) {
+			if (eventfd_read(e->efd, &v))
+				die("eventfd_read");
+		} else if (++spins > SPINS) {
+			sched_yield();
+		}
+	}
+	memcpy(buf, r->slots + (tail % RING_SLOTS) * e->slot_size, len);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *map_shared(int fd, size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (p == MAP_FAILED)
+		die("mmap");
+	return p;
+}
+
+static void munmap_teardown(struct chan *c)
+{
+	munmap(c->shm, c->shm_size);
+}
+
+static int memfd_setup(struct chan *c, size_t max)
+{
+	int fd, i;
+
+	fd = syscall(SYS_memfd_create, "ipc-bench", 0);
+	if (fd < 0)
+		return -1;
+	c->shm_size = rings_size(max);
+	if (ftruncate(fd, c->shm_size))
+		die("ftruncate");
+	c->shm = map_shared(fd, c->shm_size);
+	close(fd);
+	rings_init(c, max);
+	for (i = 0; i < 2; i++) {
+		c->dir[i].efd = eventfd(0, 0);
+		if (c->dir[i].efd < 0)
+			die("eventfd");
+	}
+	return 0;
+}
+
+static void memfd_teardown(struct chan *c)
+{
+	close(c->dir[0].efd);
+	close(c->dir[1].efd);
+	munmap_teardown(c);
+}
+
+static int posix_shm_setup(struct chan *c, size_t max)
+{
+	char name[32];
+	int fd;
+
+	snprintf(name, sizeof(name), "/ipc-bench-%d", (int)getpid());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return -1;
+	shm_unlink(name);
+	c->shm_size = rings_size(max);
+	if (ftruncate(fd, c->shm_size))
+		die("ftruncate");
+	c->shm = map_shared(fd, c->shm_size);
+	close(fd);
+	rings_init(c, max);
+	return 0;
+}
+
+/* The segment of shared-memory-sysv, between two user processes: the kernel
+ * server there polls once a second and reports its own timings. */
+static int sysv_setup(struct chan *c, size_t max)
+{
+	c->shm_size = rings_size(max);
+	c->shmid = shmget(IPC_PRIVATE, c->shm_size, IPC_CREAT | 0600);
+	if (c->shmid < 0)
+		return -1;
+	c->shm = shmat(c->shmid, NULL, 0);
+	/* Destroyed once both processes detach. */
+	shmctl(c->shmid, IPC_RMID, NULL);
+	if (c->shm == (void *)-1)
+		die("shmat");
+	rings_init(c, max);
+	return 0;
+}
+
+static void sysv_teardown(struct chan *c)
+{
+	shmdt(c->shm);
+}
+
+static int lkmc_setup(struct chan *c, size_t max)
+{
+	struct lkmc_attach arg;
+	int fd;
+
+	fd = open(mmap_file, O_RDWR);
+	if (fd < 0)
+		return -1;
+	memset(&arg, 0, sizeof(arg));
+	snprintf(arg.name, sizeof(arg.name), "ipc-bench-%d-%zu", (int)getpid(), max);
+	c->shm_size = rings_size(max);
+	arg.size = c->shm_size;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &arg)) {
+		close(fd);
+		return -1;
+	}
+	c->shm = map_shared(fd, c->shm_size);
+	/* The mapping keeps the buffer alive. */
+	close(fd);
+	rings_init(c, max);
+	return 0;
+}
+
+static const struct transport transports[] = {
+	{ "pipe", pipe_setup, fds_teardown, stream_send, stream_recv },
+	{ "unix-stream", stream_setup, sockets_teardown, stream_send, stream_recv },
+	{ "unix-seqpacket", seqpacket_setup, sockets_teardown, packet_send, packet_recv },
+	{ "eventfd-memfd", memfd_setup, memfd_teardown, ring_send, ring_recv },
+	{ "posix-shm", posix_shm_setup, munmap_teardown, ring_send, ring_recv },
+	{ "sysv-shm", sysv_setup, sysv_teardown, ring_send, ring_recv },
+	{ "lkmc_mmap", lkmc_setup, munmap_teardown, ring_send, ring_recv },
+};
+
+#define NR_TRANSPORTS	(sizeof(transports) / sizeof(transports[0]))
+
+/* Child: echo messages rounds times, then ack messages streamed ones. */
+static void child(const struct transport *t, struct chan *c, size_t size,
+		unsigned long rounds, unsigned long messages, char *buf)
+{
+	unsigned long i;
+
+	for (i = 0; i < rounds; i++) {
+		t->recv(&c->dir[0], buf, size);
+		t->send(&c->dir[1], buf, size);
+	}
+	for (i = 0; i < messages; i++)
+		t->recv(&c->dir[0], buf, size);
+	t->send(&c->dir[1], buf, 1);
+}
+
+/* @return 0, or -1 if the transport is not available */
+static int run(const struct transport *t, size_t size, unsigned long rounds,
+		double *rtt_us, double *mb_s, double *msg_s)
+{
+	unsigned long messages, i;
+	struct chan c;
+	double t0, t1;
+	char *buf;
+	pid_t pid;
+	int status;
+
+	messages = BYTES_PER_RUN / size;
+	if (messages > MAX_MESSAGES)
+		messages = MAX_MESSAGES;
+	memset(&c, 0, sizeof(c));
+	if (t->setup(&c, size))
+		return -1;
+	buf = malloc(size);
+	assert(buf);
+	memset(buf, 'a', size);
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		child(t, &c, size, rounds, messages, buf);
+		_exit(EXIT_SUCCESS);
+	}
+
+	t0 = now();
+	for (i = 0; i < rounds; i++) {
+		t->send(&c.dir[0], buf, size);
+		t->recv(&c.dir[1], buf, size);
+	}
+	t1 = now();
+	*rtt_us = (t1 - t0) / rounds * 1e6;
+
+	t0 = now();
+	for (i = 0; i < messages; i++)
+		t->send(&c.dir[0], buf, size);
+	t->recv(&c.dir[1], buf, 1);
+	t1 = now();
+	*mb_s = (double)messages * size / (t1 - t0) / 1e6;
+	*msg_s = messages / (t1 - t0);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		die("child");
+	free(buf);
+	t->teardown(&c);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	double rtt_us, mb_s, msg_s;
+	unsigned long rounds;
+	size_t i, j;
+
+	if (argc > 1 && !strcmp(argv[1], "-h")) {
+		printf("Usage: %s [round_trips] [mmap_file] [transport]\n", argv[0]);
+		return EXIT_SUCCESS;
+	}
+	rounds = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000;
+	if (argc > 2)
+		mmap_file = argv[2];
+	assert(rounds);
+
+	printf("%-16s %10s %12s %12s %12s\n", "transport", "msg_size", "rtt_us", "MB/s", "msg/s");
+	for (i = 0; i < NR_TRANSPORTS; i++) {
+		if (argc > 3 && strcmp(argv[3], transports[i].name))
+			continue;
+		for (j = 0; j < NR_SIZES; j++) {
+			if (run(&transports[i], sizes[j], rounds, &rtt_us, &mb_s, &msg_s)) {
+				printf("%-16s %10zu %12s %12s %12s\n", transports[i].name,
+						sizes[j], "-", "-", "-");
+				continue;
+			}
+			printf("%-16s %10zu %12.2f %12.0f %12.0f\n", transports[i].name,
+					sizes[j], rtt_us, mb_s, msg_s);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uint64_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_BATCH */
+
+enum { BUFFER_SIZE = 1 << 20, MSG_SIZE = 64, MESSAGES = 1 << 18 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* @return the number of commands done, with the batch ioctl failures fatal */
+static unsigned batch(int fd, struct lkmc_cmd *cmds, unsigned count, unsigned flags)
+{
+	struct lkmc_batch b;
+
+	memset(&b, 0, sizeof(b));
+	b.version = LKMC_ABI_VERSION;
+	b.flags = flags;
+	b.count = count;
+	b.cmds = (uintptr_t)cmds;
+	if (ioctl(fd, LKMC_IOC_BATCH, &b)) {
+		perror("ioctl LKMC_IOC_BATCH");
+		assert(0);
+	}
+	return b.done;
+}
+
+/* Write MESSAGES messages of len bytes round robin into the buffer,
+ * per commands per ioctl. @return ns per message */
+static double run(int fd, const char *msg, size_t len, unsigned per)
+{
+	struct lkmc_cmd cmds[LKMC_BATCH_MAX];
+	unsigned i, j, slots = BUFFER_SIZE / len;
+	double t0;
+
+	memset(cmds, 0, sizeof(cmds));
+	t0 = now();
+	for (i = 0; i < MESSAGES; i += per) {
+		for (j = 0; j < per; j++) {
+			cmds[j].op = LKMC_OP_COPY_IN;
+			cmds[j].off = (uint64_t)((i + j) % slots) * len;
+			cmds[j].len = len;
+			cmds[j].addr = (uintptr_t)msg;
+		}
+		assert(batch(fd, cmds, per, LKMC_BATCH_STOP) == per);
+		assert(cmds[per - 1].result == (int64_t)len);
+	}
+	return (now() - t0) / MESSAGES * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned pers[] = { 1, 4, 16, 64, 256, 1024 };
+	struct lkmc_cmd cmds[4];
+	struct {
+		struct lkmc_stats_header hdr;
+		uint64_t v[LKMC_STAT_NR];
+	} stats;
+	char msg[MSG_SIZE], out[MSG_SIZE];
+	double base = 0, ns;
+	unsigned version, i;
+	size_t len;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [msg_size]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	len = argc > 2 ? strtoull(argv[2], NULL, 0) : MSG_SIZE;
+	assert(len && len <= sizeof(msg));
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	if (ioctl(fd, LKMC_IOC_VERSION, &version)) {
+		perror("ioctl LKMC_IOC_VERSION");
+		assert(0);
+	}
+	printf("abi version = %u\n", version);
+	assert(version >= LKMC_ABI_VERSION);
+
+	/* Grow the private page, write and read back a message, all in one entry. */
+	memset(msg, 'a', sizeof(msg));
+	memset(cmds, 0, sizeof(cmds));
+	cmds[0].op = LKMC_OP_RESIZE;
+	cmds[0].len = BUFFER_SIZE;
+	cmds[1].op = LKMC_OP_COPY_IN;
+	cmds[1].off = BUFFER_SIZE - len;
+	cmds[1].len = len;
+	cmds[1].addr = (uintptr_t)msg;
+	cmds[2].op = LKMC_OP_FENCE;
+	cmds[3].op = LKMC_OP_COPY_OUT;
+	cmds[3].off = BUFFER_SIZE - len;
+	cmds[3].len = len;
+	cmds[3].addr = (uintptr_t)out;
+	if (batch(fd, cmds, 4, LKMC_BATCH_STOP) != 4) {
+		for (i = 0; i < 4; i++)
+			printf("cmd %u result = %lld\n", i, (long long)cmds[i].result);
+		assert(0);
+	}
+	assert(!memcmp(msg, out, len));
+
+	printf("msg_size = %zu\n", len);
+	printf("per_ioctl ns_per_msg speedup\n");
+	for (i = 0; i < sizeof(pers) / sizeof(pers[0]); i++) {
+		ns = run(fd, msg, len, pers[i]);
+		if (!i)
+			base = ns;
+		printf("%u %.1f %.2f\n", pers[i], ns, base / ns);
+	}
+
+	cmds[0].op = LKMC_OP_STATS;
+	cmds[0].len = sizeof(stats);
+	cmds[0].addr = (uintptr_t)&stats;
+	assert(batch(fd, cmds, 1, 0) == 1);
+	assert(cmds[0].result > 0 && stats.hdr.magic == LKMC_STATS_MAGIC);
+	printf("bytes_written = %llu\n",
+			(unsigned long long)stats.v[LKMC_STAT_BYTES_WRITTEN]);
+
+	close(fd);
+	return EXIT_SUCCESS;
+}
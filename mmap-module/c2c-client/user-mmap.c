@@ -0,0 +1,234 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE         /* sched_setaffinity */
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uint64_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_CONSUMER_START */
+#include "../topology.h" /* topology_read, topology_placement */
+
+/* Core to core latency: bounce the first cache line of the lkmc_mmap page
+ * between two CPUs. The pinger stores an odd value and waits for the ponger
+ * to store the next even one.
+ *
+ * user: both ends are threads of this process, each with its own mapping
+ * of the page, as in test-user-mmap.c.
+ * kernel: the ponger is the module's LKMC_CONSUMER_PINGPONG thread.
+ *
+ * Each cell is the one way latency, half the best round trip average of
+ * REPEATS runs. */
+
+enum { REPEATS = 5 };
+
+struct pinger {
+	volatile uint64_t *line;
+	int cpu;
+	unsigned long rounds;
+	pthread_barrier_t *start;
+};
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		perror("sched_setaffinity");
+		assert(0);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* @return seconds for rounds round trips */
+static double ping(volatile uint64_t *line, unsigned long rounds)
+{
+	uint64_t v = __atomic_load_n(line, __ATOMIC_ACQUIRE) & ~(uint64_t)1;
+	unsigned long i;
+	double t0 = now();
+
+	for (i = 0; i < rounds; i++, v += 2) {
+		__atomic_store_n(line, v + 1, __ATOMIC_RELEASE);
+		while (__atomic_load_n(line, __ATOMIC_ACQUIRE) != v + 2)
+			;
+	}
+	return now() - t0;
+}
+
+static void *pong(void *arg)
+{
+	struct pinger *p = arg;
+	unsigned long i;
+	uint64_t v;
+	int r;
+
+	pin(p->cpu);
+	pthread_barrier_wait(p->start);
+	for (r = 0; r < REPEATS; r++) {
+		for (i = 0; i < p->rounds; i++) {
+			while (!((v = __atomic_load_n(p->line, __ATOMIC_ACQUIRE)) & 1))
+				;
+			__atomic_store_n(p->line, v + 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+static double best(volatile uint64_t *line, unsigned long rounds)
+{
+	double t, min = 0;
+	int r;
+
+	for (r = 0; r < REPEATS; r++) {
+		t = ping(line, rounds);
+		if (!r || t < min)
+			min = t;
+	}
+	return min;
+}
+
+/* @return one way nanoseconds between a and b, both in user space */
+static double user_pair(volatile uint64_t *line_a, volatile uint64_t *line_b, int a, int b,
+		unsigned long rounds)
+{
+	pthread_barrier_t start;
+	struct pinger p;
+	pthread_t thread;
+	double t;
+
+	assert(!pthread_barrier_init(&start, NULL, 2));
+	p.line = line_b;
+	p.cpu = b;
+	p.rounds = rounds;
+	p.start = &start;
+	pin(a);
+	assert(!pthread_create(&thread, NULL, pong, &p));
+	pthread_barrier_wait(&start);
+	t = best(line_a, rounds);
+	assert(!pthread_join(thread, NULL));
+	pthread_barrier_destroy(&start);
+	return t * 1e9 / rounds / 2;
+}
+
+/* @return one way nanoseconds between user space on a and the kernel on b */
+static double kernel_pair(int fd, volatile uint64_t *line, int a, int b, unsigned long rounds)
+{
+	struct lkmc_consumer consumer;
+	double t;
+
+	memset(&consumer, 0, sizeof(consumer));
+	consumer.cpu = b;
+	consumer.flags = LKMC_CONSUMER_PINGPONG;
+	pin(a);
+	if (ioctl(fd, LKMC_IOC_CONSUMER_START, &consumer)) {
+		perror("LKMC_IOC_CONSUMER_START");
+		assert(0);
+	}
+	t = best(line, rounds);
+	assert(!ioctl(fd, LKMC_IOC_CONSUMER_STOP, &consumer));
+	assert(consumer.msgs == REPEATS * rounds);
+	return t * 1e9 / rounds / 2;
+}
+
+static void matrix(const char *title, int fd, volatile uint64_t *line_a, volatile uint64_t *line_b,
+		const struct cpu_topology *cpus, int n, unsigned long rounds)
+{
+	double ns, sum[PLACE_NR] = { 0 };
+	int count[PLACE_NR] = { 0 };
+	enum placement place;
+	int i, j;
+
+	printf("%s, one way ns, rows ping from, columns pong on:\n%6s", title, "");
+	for (j = 0; j < n; j++)
+		printf(" %6d", cpus[j].cpu);
+	putchar('\n');
+	for (i = 0; i < n; i++) {
+		printf("%6d", cpus[i].cpu);
+		for (j = 0; j < n; j++) {
+			/* Spinning against itself on one CPU only measures the scheduler. */
+			if (i == j) {
+				printf(" %6s", "-");
+				continue;
+			}
+			if (fd < 0)
+				ns = user_pair(line_a, line_b, cpus[i].cpu, cpus[j].cpu, rounds);
+			else
+				ns = kernel_pair(fd, line_a, cpus[i].cpu, cpus[j].cpu, rounds);
+			place = topology_placement(&cpus[i], &cpus[j]);
+			sum[place] += ns;
+			count[place]++;
+			printf(" %6.1f", ns);
+			fflush(stdout);
+		}
+		putchar('\n');
+	}
+	for (place = 0; place < PLACE_NR; place++)
+		if (count[place])
+			printf("%s mean %s: %.1f ns\n", title, placement_names[place],
+					sum[place] / count[place]);
+}
+
+int main(int argc, char **argv)
+{
+	static struct cpu_topology cpus[TOPOLOGY_MAX_CPUS];
+	volatile uint64_t *address1, *address2;
+	const char *mode;
+	unsigned long rounds;
+	long page_size;
+	int fd, n;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [user|kernel|both] [round_trips]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	mode = argc > 2 ? argv[2] : "both";
+	rounds = argc > 3 ? strtoul(argv[3], NULL, 0) : 100000;
+	assert(rounds);
+	page_size = sysconf(_SC_PAGE_SIZE);
+	n = topology_read(cpus, TOPOLOGY_MAX_CPUS);
+	assert(n > 0);
+	if (n < 2)
+		printf("only one CPU allowed, nothing to bounce between\n");
+
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	/* Two mappings of the same page, one per end. */
+	address1 = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	address2 = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (address1 == MAP_FAILED || address2 == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	assert(address1 != address2);
+	*address1 = 0;
+	assert(*address2 == 0);
+
+	if (n > 1 && strcmp(mode, "kernel"))
+		matrix("user-user", -1, address1, address2, cpus, n, rounds);
+	if (n > 1 && strcmp(mode, "user"))
+		matrix("user-kernel", fd, address1, NULL, cpus, n, rounds);
+
+	munmap((void *)address1, page_size);
+	munmap((void *)address2, page_size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,119 @@
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* MAP_POPULATE */
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { ITERATIONS = 10000 };
+
+struct worker {
+	pthread_t thread;
+	const char *path;
+	unsigned long iterations;
+	int populate;
+	double *latencies; /* Seconds, one per iteration. */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* open -> mmap -> first touch -> munmap -> close, timing each round. */
+static void *churn(void *arg)
+{
+	struct worker *w = arg;
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile char *address;
+	unsigned long i;
+	double t0;
+	int fd;
+
+	for (i = 0; i < w->iterations; i++) {
+		t0 = now();
+		fd = open(w->path, O_RDWR);
+		if (fd < 0) {
+			perror("open");
+			assert(0);
+		}
+		address = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | (w->populate ? MAP_POPULATE : 0), fd, 0);
+		if (address == MAP_FAILED) {
+			perror("mmap");
+			assert(0);
+		}
+		address[0] = 'b';
+		if (munmap((void *)address, page_size)) {
+			perror("munmap");
+			assert(0);
+		}
+		close(fd);
+		w->latencies[i] = now() - t0;
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	struct worker *workers;
+	unsigned long iterations, total;
+	unsigned nthreads, i;
+	double *latencies, t0, t1;
+	int populate;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [threads] [iterations] [populate]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	nthreads = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+	iterations = argc > 3 ? strtoul(argv[3], NULL, 0) : ITERATIONS;
+	populate = argc > 4 && !strcmp(argv[4], "populate");
+	assert(nthreads && iterations);
+
+	total = nthreads * iterations;
+	latencies = malloc(total * sizeof(*latencies));
+	workers = calloc(nthreads, sizeof(*workers));
+	assert(latencies && workers);
+	t0 = now();
+	for (i = 0; i < nthreads; i++) {
+		workers[i].path = argv[1];
+		workers[i].iterations = iterations;
+		workers[i].populate = populate;
+		workers[i].latencies = latencies + i * iterations;
+		assert(!pthread_create(&workers[i].thread, NULL, churn, &workers[i]));
+	}
+	for (i = 0; i < nthreads; i++)
+		assert(!pthread_join(workers[i].thread, NULL));
+	t1 = now();
+
+	qsort(latencies, total, sizeof(*latencies), cmp_double);
+	printf("threads = %u\n", nthreads);
+	printf("populate = %d\n", populate);
+	printf("ops = %lu\n", total);
+	printf("ops_per_s = %.0f\n", total / (t1 - t0));
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		printf("p%g_us = %.2f\n", percentiles[i],
+				latencies[(unsigned long)(percentiles[i] / 100 * (total - 1))] * 1e6);
+	printf("max_us = %.2f\n", latencies[total - 1] * 1e6);
+
+	free(workers);
+	free(latencies);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE         /* sched_getcpu */
+#include <assert.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uintmax_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_CONSUMER_START */
+#include "../lkmc_mpmc.h" /* lkmc_mpmc_* */
+#include "../rt.h" /* rt_setup */
+
+/* Stream messages from this process to the kernel consumer thread through
+ * an MPMC queue. Place the two with the CPU argument and taskset, or run it
+ * under ../../placement for the whole matrix. */
+
+enum { SLOT_SIZE = 64, CAPACITY = 4096, SPINS = 1000 };
+
+int main(int argc, char **argv)
+{
+	unsigned char msg[SLOT_SIZE - sizeof(struct lkmc_mpmc_slot)];
+	struct lkmc_attach attach;
+	struct lkmc_mpmc_init init;
+	struct lkmc_consumer consumer;
+	struct timespec start, end;
+	struct lkmc_mpmc q;
+	uint64_t i, items;
+	unsigned int spins;
+	long page_size;
+	double secs;
+	void *base;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [kernel_cpu] [items]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (rt_setup())
+		return EXIT_FAILURE;
+	memset(&consumer, 0, sizeof(consumer));
+	consumer.cpu = argc > 2 ? atoi(argv[2]) : -1;
+	items = argc > 3 ? strtoull(argv[3], NULL, 0) : 1 << 24;
+	page_size = sysconf(_SC_PAGE_SIZE);
+
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&attach, 0, sizeof(attach));
+	snprintf(attach.name, sizeof(attach.name), "consumer-%ju", (uintmax_t)getpid());
+	attach.size = (lkmc_mpmc_size(SLOT_SIZE, CAPACITY) + page_size - 1) & ~(page_size - 1);
+	memset(&init, 0, sizeof(init));
+	init.slot_size = SLOT_SIZE;
+	init.capacity = CAPACITY;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &attach) || ioctl(fd, LKMC_IOC_MPMC_INIT, &init)) {
+		perror("ioctl");
+		assert(0);
+	}
+	base = mmap(NULL, attach.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	assert(!lkmc_mpmc_open(&q, base, attach.size));
+	if (ioctl(fd, LKMC_IOC_CONSUMER_START, &consumer)) {
+		perror("LKMC_IOC_CONSUMER_START");
+		assert(0);
+	}
+
+	memset(msg, 0, sizeof(msg));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < items; i++) {
+		memcpy(msg, &i, sizeof(i));
+		/* Yield now and then in case the consumer shares this CPU. */
+		for (spins = 0; lkmc_mpmc_enqueue(&q, msg, sizeof(msg)) == -EAGAIN; spins++)
+			if (spins >= SPINS)
+				sched_yield();
+	}
+	for (spins = 0; lkmc_mpmc_load_acquire(&q.hdr->dequeue_pos) != items; spins++)
+		if (spins >= SPINS)
+			sched_yield();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (ioctl(fd, LKMC_IOC_CONSUMER_STOP, &consumer)) {
+		perror("LKMC_IOC_CONSUMER_STOP");
+		assert(0);
+	}
+	assert(consumer.msgs == items);
+	assert(consumer.bytes == items * sizeof(msg));
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-10s %-10s %12s %12s\n", "user_cpu", "kernel_cpu", "Mmsg/s", "ns/msg");
+	printf("%-10d %-10d %12.2f %12.1f\n", sched_getcpu(), consumer.cpu,
+			items / secs / 1e6, secs * 1e9 / items);
+
+	munmap(base, attach.size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+#ifndef COPY_KERNELS_H
+#define COPY_KERNELS_H
+
+/* Selectable memory copy routines for the mmap clients.
+ *
+ * The SIMD kernels stream to the destination with non-temporal stores, which
+ * bypass the cache: the data goes straight to the shared pages instead of
+ * evicting the producer's working set. Each kernel is compiled for its own
+ * instruction set and picked at run time after checking the CPU.
+ */
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uintptr_t */
+#include <string.h> /* memcpy, strcmp */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef void *(*copy_fn)(void *dst, const void *src, size_t len);
+
+struct copy_kernel {
+	const char *name;
+	copy_fn copy;
+	int (*supported)(void);
+};
+
+static int copy_always(void)
+{
+	return 1;
+}
+
+#if defined(__x86_64__)
+static void *copy_rep_movsb(void *dst, const void *src, size_t len)
+{
+	void *ret = dst;
+
+	__asm__ volatile("rep movsb"
+			: "+D" (dst), "+S" (src), "+c" (len)
+			:
+			: "memory");
+	return ret;
+}
+
+/* Copy the head with memcpy until dst is aligned to align.
+ * @return the number of bytes copied */
+static size_t copy_head(char *dst, const char *src, size_t len, size_t align)
+{
+	size_t head = (align - ((uintptr_t)dst & (align - 1))) & (align - 1);
+
+	if (head > len)
+		head = len;
+	memcpy(dst, src, head);
+	return head;
+}
+
+__attribute__((target("avx2")))
+static void *copy_avx2_nt(void *dst, const void *src, size_t len)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t i;
+
+	i = copy_head(d, s, len, 32);
+	if (!(((uintptr_t)s + i) & 31)) {
+		for (; i + 32 <= len; i += 32)
+			_mm256_stream_si256((__m256i *)(d + i),
+					_mm256_load_si256((const __m256i *)(s + i)));
+	} else {
+		for (; i + 32 <= len; i += 32)
+			_mm256_stream_si256((__m256i *)(d + i),
+					_mm256_loadu_si256((const __m256i *)(s + i)));
+	}
+	_mm_sfence();
+	memcpy(d + i, s + i, len - i);
+	return dst;
+}
+
+static int copy_avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx512f")))
+static void *copy_avx512_nt(void *dst, const void *src, size_t len)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t i;
+
+	i = copy_head(d, s, len, 64);
+	if (!(((uintptr_t)s + i) & 63)) {
+		for (; i + 64 <= len; i += 64)
+			_mm512_stream_si512((void *)(d + i),
+					_mm512_load_si512((const void *)(s + i)));
+	} else {
+		for (; i + 64 <= len; i += 64)
+			_mm512_stream_si512((void *)(d + i),
+					_mm512_loadu_si512((const void *)(s + i)));
+	}
+	_mm_sfence();
+	memcpy(d + i, s + i, len - i);
+	return dst;
+}
+
+static int copy_avx512_supported(void)
+{
+	return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+static const struct copy_kernel copy_kernels[] = {
+	{ "memcpy", memcpy, copy_always },
+#if defined(__x86_64__)
+	{ "rep-movsb", copy_rep_movsb, copy_always },
+	{ "avx2-nt", copy_avx2_nt, copy_avx2_supported },
+	{ "avx512-nt", copy_avx512_nt, copy_avx512_supported },
+#endif
+};
+
+#define COPY_KERNELS_NR	(sizeof(copy_kernels) / sizeof(copy_kernels[0]))
+
+/* @return the named kernel if this CPU can run it, NULL otherwise */
+static const struct copy_kernel *copy_kernel_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < COPY_KERNELS_NR; i++)
+		if (!strcmp(copy_kernels[i].name, name))
+			return copy_kernels[i].supported() ? &copy_kernels[i] : NULL;
+	return NULL;
+}
+
+/* @return the last, widest, kernel of the table this CPU supports */
+static const struct copy_kernel *copy_kernel_best(void)
+{
+	size_t i;
+
+	for (i = COPY_KERNELS_NR; i > 0; i--)
+		if (copy_kernels[i - 1].supported())
+			return &copy_kernels[i - 1];
+	return &copy_kernels[0];
+}
+
+#endif
@@ -0,0 +1,168 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE         /* CPU_SET */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uintmax_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_ATTACH, LKMC_IOC_DOORBELL */
+#include "../rt.h" /* rt_setup */
+
+/* Moving n bytes through the device, for n from 64 B to 64 MiB:
+ *
+ * - to the kernel: write(), which is copy_from_user(), against memcpy() into
+ *   the mapping followed by LKMC_IOC_DOORBELL.
+ * - from the kernel: read(), which is copy_to_user(), against the doorbell
+ *   followed by memcpy() out of the mapping.
+ *
+ * Both sides pay one kernel entry per message, so the difference is the
+ * copy and where it runs. The crossover is the smallest size from which the
+ * mapping wins at every larger size. */
+
+#define MIN_SIZE	64
+#define MAX_SIZE	(64UL << 20)
+#define BYTES_PER_SIZE	(256UL << 20)
+
+enum { MIN_ITERS = 16, MAX_ITERS = 100000 };
+
+enum method { WRITE, MAP_TO, READ, MAP_FROM, METHODS_NR };
+
+static const char *const method_names[METHODS_NR] = {
+	[WRITE] = "write_ns",
+	[MAP_TO] = "map+bell_ns",
+	[READ] = "read_ns",
+	[MAP_FROM] = "bell+map_ns",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void doorbell(int fd, size_t n)
+{
+	if (ioctl(fd, LKMC_IOC_DOORBELL, (unsigned long)n)) {
+		perror("LKMC_IOC_DOORBELL");
+		assert(0);
+	}
+}
+
+/* @return nanoseconds per message of n bytes */
+static double measure(enum method m, int fd, char *map, char *ubuf, size_t n)
+{
+	unsigned long i, iters = BYTES_PER_SIZE / n;
+	double t0;
+
+	if (iters < MIN_ITERS)
+		iters = MIN_ITERS;
+	if (iters > MAX_ITERS)
+		iters = MAX_ITERS;
+	t0 = now();
+	for (i = 0; i < iters; i++) {
+		switch (m) {
+		case WRITE:
+			assert(write(fd, ubuf, n) == (ssize_t)n);
+			break;
+		case MAP_TO:
+			memcpy(map, ubuf, n);
+			doorbell(fd, n);
+			break;
+		case READ:
+			assert(read(fd, ubuf, n) == (ssize_t)n);
+			break;
+		case MAP_FROM:
+			doorbell(fd, n);
+			memcpy(ubuf, map, n);
+			break;
+		default:
+			assert(0);
+		}
+	}
+	return (now() - t0) * 1e9 / iters;
+}
+
+static void print_crossover(const char *what, const size_t *sizes, const int *map_wins, int nr)
+{
+	int i = nr;
+
+	while (i > 0 && map_wins[i - 1])
+		i--;
+	if (i == nr)
+		printf("%s: the copy wins at every size\n", what);
+	else
+		printf("%s: the mapping wins from %zu bytes\n", what, sizes[i]);
+}
+
+int main(int argc, char **argv)
+{
+	struct lkmc_attach attach;
+	size_t sizes[32], n;
+	int to_wins[32], from_wins[32];
+	double ns[METHODS_NR];
+	char *map, *ubuf;
+	int fd, m, nr = 0;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (rt_setup())
+		return EXIT_FAILURE;
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&attach, 0, sizeof(attach));
+	snprintf(attach.name, sizeof(attach.name), "crossover-%ju", (uintmax_t)getpid());
+	attach.size = MAX_SIZE;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &attach)) {
+		perror("LKMC_IOC_ATTACH, max_size too small?");
+		assert(0);
+	}
+	map = mmap(NULL, MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	ubuf = malloc(MAX_SIZE);
+	assert(ubuf);
+	/* Fault everything in up front, only steady state copies are timed. */
+	memset(map, 1, MAX_SIZE);
+	memset(ubuf, 2, MAX_SIZE);
+
+	printf("%-10s", "size");
+	for (m = 0; m < METHODS_NR; m++)
+		printf(" %12s", method_names[m]);
+	printf(" %10s %10s\n", "to_GB/s", "from_GB/s");
+	for (n = MIN_SIZE; n <= MAX_SIZE; n *= 4, nr++) {
+		for (m = 0; m < METHODS_NR; m++)
+			ns[m] = measure(m, fd, map, ubuf, n);
+		sizes[nr] = n;
+		to_wins[nr] = ns[MAP_TO] < ns[WRITE];
+		from_wins[nr] = ns[MAP_FROM] < ns[READ];
+		printf("%-10zu", n);
+		for (m = 0; m < METHODS_NR; m++)
+			printf(" %12.1f", ns[m]);
+		/* Of the faster of the two ways, in each direction. */
+		printf(" %10.2f %10.2f\n",
+				n / (to_wins[nr] ? ns[MAP_TO] : ns[WRITE]),
+				n / (from_wins[nr] ? ns[MAP_FROM] : ns[READ]));
+	}
+	print_crossover("to the kernel", sizes, to_wins, nr);
+	print_crossover("from the kernel", sizes, from_wins, nr);
+
+	free(ubuf);
+	munmap(map, MAX_SIZE);
+	close(fd);
+	return EXIT_SUCCESS;
+}
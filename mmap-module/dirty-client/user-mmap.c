@@ -0,0 +1,129 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uint64_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_GET_DIRTY */
+
+enum { BUFFER_SIZE = 64 << 20, ROUNDS = 8 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t get_dirty(int fd, uint64_t *bitmap, size_t nr_pages)
+{
+	struct lkmc_dirty arg;
+
+	arg.bitmap = (uintptr_t)bitmap;
+	arg.nr_pages = nr_pages;
+	if (ioctl(fd, LKMC_IOC_GET_DIRTY, &arg)) {
+		perror("ioctl LKMC_IOC_GET_DIRTY");
+		assert(0);
+	}
+	assert(arg.nr_pages == nr_pages);
+	return arg.nr_dirty;
+}
+
+int main(int argc, char **argv)
+{
+	struct lkmc_attach attach;
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t *bitmap, *written, nr_dirty, expected;
+	size_t size, nr_pages, words, i, changed;
+	double t0, query, scan;
+	char *address, *shadow;
+	unsigned round, writes;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [bytes] [writes_per_round]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	size = argc > 2 ? strtoull(argv[2], NULL, 0) : BUFFER_SIZE;
+	nr_pages = (size + page_size - 1) / page_size;
+	size = nr_pages * page_size;
+	writes = argc > 3 ? strtoul(argv[3], NULL, 0) : nr_pages / 100 + 1;
+	words = (nr_pages + 63) / 64;
+
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&attach, 0, sizeof(attach));
+	strncpy(attach.name, "dirty-client", sizeof(attach.name) - 1);
+	attach.size = size;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &attach)) {
+		perror("ioctl LKMC_IOC_ATTACH");
+		assert(0);
+	}
+	address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	bitmap = calloc(words, sizeof(*bitmap));
+	written = calloc(words, sizeof(*written));
+	shadow = malloc(size);
+	assert(bitmap && written && shadow);
+
+	/* Start from a clean buffer and a shadow copy of it. */
+	get_dirty(fd, bitmap, nr_pages);
+	memcpy(shadow, address, size);
+
+	printf("pages = %zu\n", nr_pages);
+	printf("round dirty query_us rescan_us\n");
+	srand(1);
+	for (round = 0; round < ROUNDS; round++) {
+		memset(written, 0, words * sizeof(*written));
+		for (i = 0; i < writes; i++) {
+			size_t page = (size_t)rand() % nr_pages;
+
+			address[page * page_size + i % page_size]++;
+			written[page / 64] |= 1ULL << (page % 64);
+		}
+
+		/* What a consumer without the module's help has to do. */
+		t0 = now();
+		changed = 0;
+		for (i = 0; i < nr_pages; i++) {
+			if (memcmp(address + i * page_size, shadow + i * page_size, page_size)) {
+				memcpy(shadow + i * page_size, address + i * page_size, page_size);
+				changed++;
+			}
+		}
+		scan = now() - t0;
+
+		t0 = now();
+		nr_dirty = get_dirty(fd, bitmap, nr_pages);
+		query = now() - t0;
+
+		expected = 0;
+		for (i = 0; i < words; i++) {
+			assert(bitmap[i] == written[i]);
+			expected += __builtin_popcountll(written[i]);
+		}
+		assert(nr_dirty == expected && changed <= expected);
+		printf("%u %llu %.1f %.1f\n", round, (unsigned long long)nr_dirty,
+				query * 1e6, scan * 1e6);
+	}
+
+	free(shadow);
+	free(written);
+	free(bitmap);
+	munmap(address, size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
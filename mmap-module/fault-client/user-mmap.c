@@ -0,0 +1,148 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_ATTACH */
+
+enum { BUFFER_SIZE = 64 << 20, MAX_THREADS = 64 };
+
+struct worker {
+	pthread_t thread;
+	pthread_barrier_t *start;
+	char *base; /* First byte of this thread's range. */
+	size_t len;
+	long page_size;
+	double end;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *map(int fd, size_t len, off_t off)
+{
+	void *address = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+
+	if (address == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	return address;
+}
+
+/* One read per page, so every access is a fault. */
+static void *fault(void *arg)
+{
+	struct worker *w = arg;
+	volatile char *p = w->base;
+	size_t i;
+
+	pthread_barrier_wait(w->start);
+	for (i = 0; i < w->len; i += w->page_size)
+		(void)p[i];
+	w->end = now();
+	return NULL;
+}
+
+/* Fault the whole buffer with nthreads, each on a disjoint range. With split
+ * each thread maps its own range, so the threads only share the mm, not
+ * the VMA. @return faults per second */
+static double run(int fd, size_t size, unsigned nthreads, int split, long page_size)
+{
+	struct worker workers[MAX_THREADS];
+	pthread_barrier_t start;
+	size_t chunk = size / nthreads / page_size * page_size;
+	double t0, t1 = 0;
+	char *base = NULL;
+	unsigned i;
+
+	assert(chunk);
+	assert(!pthread_barrier_init(&start, NULL, nthreads + 1));
+	if (!split)
+		base = map(fd, size, 0);
+	for (i = 0; i < nthreads; i++) {
+		workers[i].start = &start;
+		workers[i].len = chunk;
+		workers[i].page_size = page_size;
+		workers[i].base = split ? map(fd, chunk, i * chunk) : base + i * chunk;
+		assert(!pthread_create(&workers[i].thread, NULL, fault, &workers[i]));
+	}
+	t0 = now();
+	pthread_barrier_wait(&start);
+	for (i = 0; i < nthreads; i++) {
+		assert(!pthread_join(workers[i].thread, NULL));
+		if (workers[i].end > t1)
+			t1 = workers[i].end;
+		if (split)
+			munmap(workers[i].base, chunk);
+	}
+	if (!split)
+		munmap(base, size);
+	pthread_barrier_destroy(&start);
+	return nthreads * (chunk / page_size) / (t1 - t0);
+}
+
+int main(int argc, char **argv)
+{
+	struct lkmc_attach arg;
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned max_threads, n;
+	double one = 0, rate;
+	size_t size;
+	int fd, split;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [max_threads] [bytes] [split]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	max_threads = argc > 2 ? strtoul(argv[2], NULL, 0) :
+		(unsigned long)sysconf(_SC_NPROCESSORS_ONLN);
+	size = argc > 3 ? strtoull(argv[3], NULL, 0) : BUFFER_SIZE;
+	split = argc > 4 && !strcmp(argv[4], "split");
+	if (max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+	assert(max_threads);
+
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&arg, 0, sizeof(arg));
+	strncpy(arg.name, "fault-client", sizeof(arg.name) - 1);
+	arg.size = size;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &arg)) {
+		perror("ioctl LKMC_IOC_ATTACH");
+		assert(0);
+	}
+
+	printf("bytes = %zu\n", size);
+	printf("vma = %s\n", split ? "per thread" : "shared");
+	/* Warm up: the first pass also pays for cold caches and page tables. */
+	run(fd, size, 1, split, page_size);
+	printf("threads faults_per_s scaling\n");
+	/* 1, 2, 4, ... and max_threads. */
+	for (n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+		rate = run(fd, size, n, split, page_size);
+		if (n == 1)
+			one = rate;
+		printf("%u %.0f %.2f\n", n, rate, rate / one);
+		if (n == max_threads)
+			break;
+	}
+
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE         /* CMSG_* */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uintmax_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_EXPORT */
+
+enum { BUFFER_SIZE = 1 << 20 };
+
+static void send_fd(int sock, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	if (sendmsg(sock, &msg, 0) != 1) {
+		perror("sendmsg");
+		assert(0);
+	}
+}
+
+static int recv_fd(int sock)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &msg, 0) != 1) {
+		perror("recvmsg");
+		assert(0);
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	assert(cmsg && cmsg->cmsg_type == SCM_RIGHTS);
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* The receiver knows nothing but the fd it was sent. */
+static int consumer(int sock)
+{
+	struct lkmc_buf_info info;
+	char *address;
+	int fd;
+
+	fd = recv_fd(sock);
+	printf("consumer fd = %d\n", fd);
+	if (ioctl(fd, LKMC_IOC_BUF_INFO, &info)) {
+		perror("ioctl");
+		assert(0);
+	}
+	printf("consumer size = %ju, seals = 0x%x\n", (uintmax_t)info.size, info.seals);
+	/* Sealed, so the size cannot change under this mapping. */
+	assert(info.seals & LKMC_SEAL_RESIZE);
+	address = mmap(NULL, info.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	assert(!strcmp(address, "hello from the producer"));
+	assert((unsigned char)address[info.size - 1] == 0xaa);
+	strcpy(address, "hello from the consumer");
+	munmap(address, info.size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	struct lkmc_attach attach;
+	struct lkmc_export export;
+	char *address;
+	int fd, sock[2], status;
+	pid_t pid;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock)) {
+		perror("socketpair");
+		assert(0);
+	}
+	/* Fork first: the consumer never opens the device itself. */
+	fflush(stdout);
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		close(sock[0]);
+		return consumer(sock[1]);
+	}
+	close(sock[1]);
+
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	/* A name nobody else knows, the fd is the only handle. */
+	memset(&attach, 0, sizeof(attach));
+	snprintf(attach.name, sizeof(attach.name), "fdpass-%ju", (uintmax_t)getpid());
+	attach.size = BUFFER_SIZE;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &attach)) {
+		perror("ioctl");
+		assert(0);
+	}
+	address = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	strcpy(address, "hello from the producer");
+	address[BUFFER_SIZE - 1] = (char)0xaa;
+
+	memset(&export, 0, sizeof(export));
+	export.seals = LKMC_SEAL_RESIZE;
+	if (ioctl(fd, LKMC_IOC_EXPORT, &export)) {
+		perror("ioctl");
+		assert(0);
+	}
+	printf("producer exported fd = %d\n", export.fd);
+	send_fd(sock[0], export.fd);
+	close(export.fd);
+	close(fd);
+
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+	assert(!strcmp(address, "hello from the consumer"));
+	puts("zero-copy hand-off ok");
+	munmap(address, BUFFER_SIZE);
+	return EXIT_SUCCESS;
+}
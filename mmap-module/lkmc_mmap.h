@@ -0,0 +1,236 @@
+#ifndef LKMC_MMAP_H
+#define LKMC_MMAP_H
+
+/* Interface shared between the lkmc_mmap module and its user space clients. */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* debugfs/lkmc_mmap/{stats,stats.bin} and debugfs/lkmc_mmap/opens/<id>{,.bin}
+ *
+ * The opens/ entries only exist for files opened while the open_stats module
+ * parameter is set. LKMC_OP_STATS reads the counters of any open.
+ *
+ * The text files contain one "<name> <value>" line per counter.
+ * The .bin files contain a struct lkmc_stats_header followed by nr __u64
+ * values indexed by enum lkmc_stat. Counters are only ever appended, so a
+ * reader built against an older header can keep using the first nr values.
+ **/
+#define LKMC_STATS_MAGIC	0x636d6b6c /* "lkmc" */
+#define LKMC_STATS_VERSION	1
+
+enum lkmc_stat {
+	LKMC_STAT_OPENS,
+	LKMC_STAT_FAULTS,
+	LKMC_STAT_PAGES_MAPPED,
+	LKMC_STAT_BYTES_READ,
+	LKMC_STAT_BYTES_WRITTEN,
+	LKMC_STAT_SPLICE_PAGES,
+	LKMC_STAT_WAKEUPS,	/* Doorbells, and kernel consumers woken from a sleep. */
+	LKMC_STAT_FAULT_NS,
+	LKMC_STAT_MMAP_NS,
+	LKMC_STAT_READ_NS,
+	LKMC_STAT_WRITE_NS,
+	LKMC_STAT_SPLICE_NS,
+	LKMC_STAT_POOL_HITS,
+	LKMC_STAT_POOL_MISSES,
+	LKMC_STAT_MKWRITES,
+	LKMC_STAT_COW_COPIES,
+	LKMC_STAT_NR,
+};
+
+struct lkmc_stats_header {
+	__u32 magic;
+	__u32 version;
+	__u32 nr;
+	__u32 reserved;
+};
+
+#define LKMC_IOC_MAGIC		'L'
+#define LKMC_NAME_LEN		32
+
+/* Attach the open file to the named buffer, creating it with size bytes
+ * (rounded up to pages, one page if 0) if no open holds that name yet.
+ * Must be issued before the file is mapped. All opens attached to a name
+ * share the same pages, and the buffer lives until the last file and
+ * mapping referring to it are gone. Only a file opened for writing creates
+ * a buffer, on others a name nobody holds fails with ENOENT.
+ **/
+struct lkmc_attach {
+	char name[LKMC_NAME_LEN];
+	__u64 size;
+};
+
+#define LKMC_IOC_ATTACH		_IOW(LKMC_IOC_MAGIC, 1, struct lkmc_attach)
+
+/* Cache attribute of the following mmap() calls on this open file. The
+ * kernel direct map of the buffer pages is switched to match, so mmap()
+ * fails with EBUSY while the buffer is mapped under another attribute or
+ * shares pages with a snapshot or a pipe, and snapshots of a WC or UC
+ * buffer fail with EBUSY. WC and UC are x86 only, elsewhere mmap() fails
+ * with EOPNOTSUPP. Takes an enum lkmc_cache by value.
+ **/
+enum lkmc_cache {
+	LKMC_CACHE_WB,
+	LKMC_CACHE_WC,
+	LKMC_CACHE_UC,
+	LKMC_CACHE_NR,
+};
+
+#define LKMC_IOC_SET_CACHE	_IO(LKMC_IOC_MAGIC, 3)
+
+/* Pin len bytes of user memory at addr so the module can use them in place,
+ * without copying. Replaces the previous registration of the open file.
+ * LKMC_IOC_UNPIN or the last close releases the pages. len is bounded by the
+ * max_size module parameter, and the pages count as locked memory of the
+ * caller against RLIMIT_MEMLOCK, ENOMEM beyond. Needs a file opened for
+ * writing, EBADF otherwise.
+ **/
+struct lkmc_pin {
+	__u64 addr;
+	__u64 len;
+};
+
+#define LKMC_IOC_PIN		_IOW(LKMC_IOC_MAGIC, 4, struct lkmc_pin)
+#define LKMC_IOC_UNPIN		_IO(LKMC_IOC_MAGIC, 5)
+/* Kernel side consumer of the pinned buffer: sum of its bytes. */
+#define LKMC_IOC_PIN_SUM	_IOR(LKMC_IOC_MAGIC, 6, __u64)
+
+/* Export the buffer of the open file as a new fd, to be handed to another
+ * process over a Unix socket with SCM_RIGHTS and mmap()ed there. Seals are
+ * added to the buffer first and, as with memfd, can never be removed.
+ * A file not opened for writing can only export LKMC_EXPORT_RDONLY fds
+ * without seals, EBADF otherwise.
+ **/
+#define LKMC_SEAL_RESIZE	0x1 /* The buffer size is fixed. */
+#define LKMC_SEAL_ALL		LKMC_SEAL_RESIZE
+
+#define LKMC_EXPORT_RDONLY	0x1 /* The new fd cannot write or map writable. */
+
+struct lkmc_export {
+	__u32 flags;
+	__u32 seals;
+	__s32 fd; /* Out. */
+	__u32 reserved;
+};
+
+struct lkmc_buf_info {
+	__u64 size;
+	__u32 seals;
+	__u32 reserved;
+};
+
+#define LKMC_IOC_EXPORT		_IOWR(LKMC_IOC_MAGIC, 7, struct lkmc_export)
+#define LKMC_IOC_BUF_INFO	_IOR(LKMC_IOC_MAGIC, 8, struct lkmc_buf_info)
+
+/* Version of the batch interface below, returned by LKMC_IOC_VERSION.
+ * Bumped when an op or field is added, a batch from an older client keeps
+ * working.
+ **/
+#define LKMC_ABI_VERSION	1
+
+#define LKMC_IOC_VERSION	_IOR(LKMC_IOC_MAGIC, 9, __u32)
+
+/* Run count commands on the buffer of the open file in one kernel entry.
+ *
+ * Commands run in order. Each one gets its result, bytes moved or -errno,
+ * and the batch goes on unless LKMC_BATCH_STOP is set. done reports how
+ * many commands ran. The ioctl itself only fails for a malformed batch.
+ **/
+enum lkmc_op {
+	LKMC_OP_NOP,
+	LKMC_OP_COPY_IN,	/* len bytes from addr to the buffer at off. */
+	LKMC_OP_COPY_OUT,	/* len bytes from the buffer at off to addr. */
+	LKMC_OP_FLUSH,		/* Write back the CPU caches of the buffer bytes. */
+	LKMC_OP_FENCE,		/* Full barrier between the commands around it. */
+	LKMC_OP_RESIZE,		/* Resize to len, only if unmapped, unshared, unsealed. */
+	LKMC_OP_STATS,		/* The open's counters as in opens/<id>.bin to addr. */
+	LKMC_OP_NR,
+};
+
+struct lkmc_cmd {
+	__u32 op;
+	__u32 reserved;
+	__u64 off;
+	__u64 len;
+	__u64 addr;
+	__s64 result; /* Out. */
+};
+
+#define LKMC_BATCH_STOP		0x1 /* Stop at the first failed command. */
+#define LKMC_BATCH_MAX		1024
+
+struct lkmc_batch {
+	__u32 version; /* LKMC_ABI_VERSION the client was built with. */
+	__u32 flags;
+	__u32 count;
+	__u32 done; /* Out. */
+	__u64 cmds; /* Array of count struct lkmc_cmd. */
+};
+
+#define LKMC_IOC_BATCH		_IOWR(LKMC_IOC_MAGIC, 10, struct lkmc_batch)
+
+/* Pages of the buffer written since the previous LKMC_IOC_GET_DIRTY, through
+ * any mapping or write path of any open. Page i is bit i % 64 of bitmap word
+ * i / 64. The reported pages are clean again when the ioctl returns: the
+ * next write to them faults and marks them anew.
+ *
+ * If nr_pages is smaller than the buffer, fails with ENOSPC and sets
+ * nr_pages to the size needed.
+ **/
+struct lkmc_dirty {
+	__u64 bitmap; /* Array of __u64 words. */
+	__u64 nr_pages; /* In: bits in bitmap. Out: pages in the buffer. */
+	__u64 nr_dirty; /* Out. */
+};
+
+#define LKMC_IOC_GET_DIRTY	_IOWR(LKMC_IOC_MAGIC, 11, struct lkmc_dirty)
+
+/* Freeze the buffer into a new buffer, sealed and returned as a read-only
+ * fd as by LKMC_IOC_EXPORT. The two share the pages until the live buffer
+ * writes one: only then is that page copied, so the cost follows the write
+ * rate, not the buffer size.
+ **/
+struct lkmc_snapshot {
+	__s32 fd; /* Out. */
+	__u32 reserved;
+};
+
+#define LKMC_IOC_SNAPSHOT	_IOR(LKMC_IOC_MAGIC, 12, struct lkmc_snapshot)
+
+/* Start a kernel thread that drains the MPMC queue (see lkmc_mpmc.h) of the
+ * attached buffer, bound to cpu. For cpu -1 the consumer_cpu module
+ * parameter decides: a CPU, the first isolated one or the scheduler. The
+ * thread runs under the SCHED_FIFO priority of consumer_prio, if set. It
+ * only counts what it dequeues: a kernel peer to place user producers
+ * against. One per open, stopped by LKMC_IOC_CONSUMER_STOP or the last close.
+ * Needs a file opened for writing, EBADF otherwise.
+ *
+ * With LKMC_CONSUMER_PINGPONG the thread instead answers on the first cache
+ * line of the buffer: whenever the __u64 at offset 0 is odd, it stores it
+ * plus one. msgs then counts the answers.
+ **/
+#define LKMC_CONSUMER_PINGPONG	0x1
+
+struct lkmc_consumer {
+	__s32 cpu;
+	__u32 flags;
+	__u64 msgs; /* Out of LKMC_IOC_CONSUMER_STOP. */
+	__u64 bytes; /* Out of LKMC_IOC_CONSUMER_STOP. */
+};
+
+#define LKMC_IOC_CONSUMER_START	_IOW(LKMC_IOC_MAGIC, 13, struct lkmc_consumer)
+#define LKMC_IOC_CONSUMER_STOP	_IOR(LKMC_IOC_MAGIC, 14, struct lkmc_consumer)
+
+/* Tell the module that the first len bytes of the buffer, written through a
+ * mapping, are ready, or that the caller is about to read them. Takes len by
+ * value and counts a wakeup. The mapped counterpart of write() and read(),
+ * which copy between the user buffer and the start of the buffer.
+ **/
+#define LKMC_IOC_DOORBELL	_IO(LKMC_IOC_MAGIC, 15)
+
+/* Does nothing: the fixed cost of an ioctl on the device. A read() of 0
+ * bytes is the same for the read path. */
+#define LKMC_IOC_NOP		_IO(LKMC_IOC_MAGIC, 16)
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef LKMC_MPMC_H
+#define LKMC_MPMC_H
+
+/* Bounded multi-producer multi-consumer queue in a shared lkmc_mmap buffer.
+ *
+ * Dmitry Vyukov's algorithm: every slot carries a sequence number, producers
+ * and consumers claim positions with one CAS and never block each other.
+ * The header and the two positions live on separate cache lines.
+ *
+ * The same code runs in user space on a mapping of the buffer and in the
+ * module on its pages. Both sides use a private copy of the geometry, which
+ * the module checks against the buffer size, so nothing in shared memory is
+ * trusted for addressing.
+ *
+ * User space:
+ *	ioctl(fd, LKMC_IOC_ATTACH, &attach);
+ *	ioctl(fd, LKMC_IOC_MPMC_INIT, &init);	(once, by any process)
+ *	base = mmap(NULL, attach.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+ *	lkmc_mpmc_open(&q, base, attach.size);
+ *	lkmc_mpmc_enqueue(&q, msg, len);
+ **/
+
+#ifdef __KERNEL__
+#include <linux/atomic.h>
+#include <linux/compiler.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#else
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h> /* sysconf */
+#include <linux/types.h>
+#endif
+
+#include "lkmc_mmap.h"
+
+#define LKMC_MPMC_MAGIC		0x636d706d /* "mpmc" */
+#define LKMC_MPMC_CACHELINE	64
+
+/* A mapper can move a slot seq ahead of the positions and keep the loops
+ * below retrying, so the kernel gives up with -EAGAIN after that many
+ * rounds and leaves it to the caller to reschedule. */
+#ifdef __KERNEL__
+#define LKMC_MPMC_RETRIES	64
+#define lkmc_mpmc_give_up(retries)	((retries) >= LKMC_MPMC_RETRIES)
+#else
+#define lkmc_mpmc_give_up(retries)	0
+#endif
+
+struct lkmc_mpmc_hdr {
+	__u32 magic;
+	__u32 slot_size; /* Power of two, at most a page, slot header included. */
+	__u64 capacity; /* Power of two. */
+	__u64 slots_off; /* Multiple of slot_size, so no slot straddles a page. */
+	__u64 enqueue_pos __attribute__((aligned(LKMC_MPMC_CACHELINE)));
+	__u64 dequeue_pos __attribute__((aligned(LKMC_MPMC_CACHELINE)));
+} __attribute__((aligned(LKMC_MPMC_CACHELINE)));
+
+struct lkmc_mpmc_slot {
+	__u64 seq;
+	__u32 len;
+	__u32 reserved;
+	unsigned char data[];
+};
+
+/* Format the attached buffer as an empty queue. Formatting a queue in use
+ * loses its contents but cannot make the module access out of bounds. */
+struct lkmc_mpmc_init {
+	__u32 slot_size;
+	__u32 reserved;
+	__u64 capacity;
+};
+
+#define LKMC_IOC_MPMC_INIT	_IOW(LKMC_IOC_MAGIC, 2, struct lkmc_mpmc_init)
+
+/* Private handle on a queue. */
+struct lkmc_mpmc {
+	struct lkmc_mpmc_hdr *hdr;
+	__u64 mask;
+	__u64 slots_off;
+	__u32 slot_size;
+#ifdef __KERNEL__
+	struct page **pages;
+#else
+	char *base;
+#endif
+};
+
+#ifdef __KERNEL__
+#define lkmc_mpmc_load(p)		READ_ONCE(*(p))
+#define lkmc_mpmc_load_acquire(p)	smp_load_acquire(p)
+#define lkmc_mpmc_store_release(p, v)	smp_store_release(p, v)
+static inline int lkmc_mpmc_cas(__u64 *p, __u64 *old, __u64 new)
+{
+	__u64 cur = cmpxchg(p, *old, new);
+
+	if (cur == *old)
+		return 1;
+	*old = cur;
+	return 0;
+}
+#else
+#define lkmc_mpmc_load(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define lkmc_mpmc_load_acquire(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define lkmc_mpmc_store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+static inline int lkmc_mpmc_cas(__u64 *p, __u64 *old, __u64 new)
+{
+	return __atomic_compare_exchange_n(p, old, new, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+#endif
+
+static inline __u32 lkmc_mpmc_payload(const struct lkmc_mpmc *q)
+{
+	return q->slot_size - sizeof(struct lkmc_mpmc_slot);
+}
+
+static inline struct lkmc_mpmc_slot *lkmc_mpmc_slot(const struct lkmc_mpmc *q, __u64 pos)
+{
+	__u64 off = q->slots_off + (pos & q->mask) * q->slot_size;
+
+#ifdef __KERNEL__
+	return (struct lkmc_mpmc_slot *)((char *)page_address(q->pages[off >> PAGE_SHIFT]) +
+			(off & ~PAGE_MASK));
+#else
+	return (struct lkmc_mpmc_slot *)(q->base + off);
+#endif
+}
+
+/* Bytes needed for a queue of that geometry. */
+static inline __u64 lkmc_mpmc_size(__u32 slot_size, __u64 capacity)
+{
+	__u64 off = (sizeof(struct lkmc_mpmc_hdr) + slot_size - 1) & ~(__u64)(slot_size - 1);
+
+	return off + capacity * slot_size;
+}
+
+/* Geometry of a queue in size bytes that both sides accept: power of two
+ * slots of two slot headers up to a page, a power of two capacity, all of
+ * it fitting. The module checks LKMC_IOC_MPMC_INIT and every queue it
+ * opens with it, lkmc_mpmc_open() the header it maps.
+ * @return 0 or -EINVAL */
+static inline int lkmc_mpmc_check(__u64 slot_size, __u64 capacity, __u64 size, __u64 page_size)
+{
+	if (slot_size < 2 * sizeof(struct lkmc_mpmc_slot) || slot_size > page_size ||
+	    (slot_size & (slot_size - 1)) || !capacity || (capacity & (capacity - 1)))
+		return -EINVAL;
+	if (capacity > size / slot_size || lkmc_mpmc_size(slot_size, capacity) > size)
+		return -EINVAL;
+	return 0;
+}
+
+/* Lay out an empty queue at hdr. The caller has checked the geometry and
+ * set q->pages or q->base. */
+static inline void lkmc_mpmc_format(struct lkmc_mpmc *q, struct lkmc_mpmc_hdr *hdr,
+		__u32 slot_size, __u64 capacity)
+{
+	__u64 i;
+
+	q->hdr = hdr;
+	q->mask = capacity - 1;
+	q->slot_size = slot_size;
+	q->slots_off = lkmc_mpmc_size(slot_size, capacity) - capacity * slot_size;
+	for (i = 0; i < capacity; i++)
+		lkmc_mpmc_slot(q, i)->seq = i;
+	hdr->slot_size = slot_size;
+	hdr->capacity = capacity;
+	hdr->slots_off = q->slots_off;
+	hdr->enqueue_pos = 0;
+	hdr->dequeue_pos = 0;
+	lkmc_mpmc_store_release(&hdr->magic, LKMC_MPMC_MAGIC);
+}
+
+/* @return 0, -EAGAIN if full or out of retries, -EMSGSIZE if len does not
+ * fit a slot. */
+static inline int lkmc_mpmc_enqueue(struct lkmc_mpmc *q, const void *data, __u32 len)
+{
+	struct lkmc_mpmc_slot *slot;
+	unsigned int retries;
+	__u64 pos, seq;
+	__s64 dif;
+
+	if (len > lkmc_mpmc_payload(q))
+		return -EMSGSIZE;
+	pos = lkmc_mpmc_load(&q->hdr->enqueue_pos);
+	for (retries = 0;; retries++) {
+		if (lkmc_mpmc_give_up(retries))
+			return -EAGAIN;
+		slot = lkmc_mpmc_slot(q, pos);
+		seq = lkmc_mpmc_load_acquire(&slot->seq);
+		dif = (__s64)(seq - pos);
+		if (dif == 0) {
+			if (lkmc_mpmc_cas(&q->hdr->enqueue_pos, &pos, pos + 1))
+				break;
+		} else if (dif < 0) {
+			return -EAGAIN;
+		} else {
+			pos = lkmc_mpmc_load(&q->hdr->enqueue_pos);
+		}
+	}
+	slot->len = len;
+	memcpy(slot->data, data, len);
+	lkmc_mpmc_store_release(&slot->seq, pos + 1);
+	return 0;
+}
+
+/* @return the message length (truncated to len), -EAGAIN if empty or out of
+ * retries. */
+static inline int lkmc_mpmc_dequeue(struct lkmc_mpmc *q, void *data, __u32 len)
+{
+	struct lkmc_mpmc_slot *slot;
+	__u64 pos, seq;
+	unsigned int retries;
+	__u32 n;
+	__s64 dif;
+
+	pos = lkmc_mpmc_load(&q->hdr->dequeue_pos);
+	for (retries = 0;; retries++) {
+		if (lkmc_mpmc_give_up(retries))
+			return -EAGAIN;
+		slot = lkmc_mpmc_slot(q, pos);
+		seq = lkmc_mpmc_load_acquire(&slot->seq);
+		dif = (__s64)(seq - (pos + 1));
+		if (dif == 0) {
+			if (lkmc_mpmc_cas(&q->hdr->dequeue_pos, &pos, pos + 1))
+				break;
+		} else if (dif < 0) {
+			return -EAGAIN;
+		} else {
+			pos = lkmc_mpmc_load(&q->hdr->dequeue_pos);
+		}
+	}
+	/* The producer may be hostile, never trust its length. */
+	n = lkmc_mpmc_load(&slot->len);
+	if (n > lkmc_mpmc_payload(q))
+		n = lkmc_mpmc_payload(q);
+	if (n > len)
+		n = len;
+	memcpy(data, slot->data, n);
+	lkmc_mpmc_store_release(&slot->seq, pos + q->mask + 1);
+	return n;
+}
+
+#ifdef __KERNEL__
+/* Kernel side handle on a named buffer formatted with LKMC_IOC_MPMC_INIT.
+ * The functions may sleep. */
+struct lkmc_queue;
+
+struct lkmc_queue *lkmc_queue_get(const char *name);
+void lkmc_queue_put(struct lkmc_queue *q);
+int lkmc_queue_enqueue(struct lkmc_queue *q, const void *data, size_t len);
+int lkmc_queue_dequeue(struct lkmc_queue *q, void *data, size_t len);
+#else
+/* Check the header of a mapped queue of size bytes and cache its geometry.
+ * @return 0 for success, -EINVAL if it is not a queue or does not fit.
+ */
+static inline int lkmc_mpmc_open(struct lkmc_mpmc *q, void *base, size_t size)
+{
+	struct lkmc_mpmc_hdr *hdr = (struct lkmc_mpmc_hdr *)base;
+
+	if (size < sizeof(*hdr) ||
+	    lkmc_mpmc_load_acquire(&hdr->magic) != LKMC_MPMC_MAGIC)
+		return -EINVAL;
+	if (lkmc_mpmc_check(hdr->slot_size, hdr->capacity, size, sysconf(_SC_PAGESIZE)))
+		return -EINVAL;
+	q->hdr = hdr;
+	q->base = (char *)base;
+	q->mask = hdr->capacity - 1;
+	q->slot_size = hdr->slot_size;
+	q->slots_off = lkmc_mpmc_size(hdr->slot_size, hdr->capacity) -
+		hdr->capacity * hdr->slot_size;
+	return 0;
+}
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+/* Tracepoints of the lkmc_mmap module.
+ *
+ * Disabled tracepoints are a static branch, so the hooks cost nothing
+ * unless enabled, e.g.:
+ * echo 1 > /sys/kernel/debug/tracing/events/lkmc_mmap/enable
+ * perf record -e 'lkmc_mmap:*' ...
+ * bpftrace -e 'tracepoint:lkmc_mmap:lkmc_fault { @ns = hist(args->ns); }'
+ * Every event is timestamped by the trace buffer, ns is the time spent in the handler.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lkmc_mmap
+
+#if !defined(_LKMC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LKMC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lkmc_fault,
+	TP_PROTO(unsigned long address, unsigned long pgoff, int ret, u64 ns),
+	TP_ARGS(address, pgoff, ret, ns),
+	TP_STRUCT__entry(
+		__field(unsigned long, address)
+		__field(unsigned long, pgoff)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->address = address;
+		__entry->pgoff = pgoff;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("address=0x%lx pgoff=%lu ret=0x%x ns=%llu",
+		__entry->address, __entry->pgoff, __entry->ret,
+		(unsigned long long)__entry->ns)
+);
+
+TRACE_EVENT(lkmc_mmap,
+	TP_PROTO(unsigned long start, unsigned long len, unsigned long pgoff, u64 ns),
+	TP_ARGS(start, len, pgoff, ns),
+	TP_STRUCT__entry(
+		__field(unsigned long, start)
+		__field(unsigned long, len)
+		__field(unsigned long, pgoff)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->start = start;
+		__entry->len = len;
+		__entry->pgoff = pgoff;
+		__entry->ns = ns;
+	),
+	TP_printk("start=0x%lx len=%lu pgoff=%lu ns=%llu",
+		__entry->start, __entry->len, __entry->pgoff,
+		(unsigned long long)__entry->ns)
+);
+
+DECLARE_EVENT_CLASS(lkmc_rw,
+	TP_PROTO(size_t len, loff_t off, ssize_t ret, u64 ns),
+	TP_ARGS(len, off, ret, ns),
+	TP_STRUCT__entry(
+		__field(size_t, len)
+		__field(loff_t, off)
+		__field(ssize_t, ret)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->len = len;
+		__entry->off = off;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+	TP_printk("len=%zu off=%lld ret=%zd ns=%llu",
+		__entry->len, (long long)__entry->off, __entry->ret,
+		(unsigned long long)__entry->ns)
+);
+
+DEFINE_EVENT(lkmc_rw, lkmc_read,
+	TP_PROTO(size_t len, loff_t off, ssize_t ret, u64 ns),
+	TP_ARGS(len, off, ret, ns)
+);
+
+DEFINE_EVENT(lkmc_rw, lkmc_write,
+	TP_PROTO(size_t len, loff_t off, ssize_t ret, u64 ns),
+	TP_ARGS(len, off, ret, ns)
+);
+
+DEFINE_EVENT(lkmc_rw, lkmc_splice,
+	TP_PROTO(size_t len, loff_t off, ssize_t ret, u64 ns),
+	TP_ARGS(len, off, ret, ns)
+);
+
+/* One event per pipe buffer consumed by a splice. */
+TRACE_EVENT(lkmc_splice_page,
+	TP_PROTO(unsigned int offset, unsigned int len),
+	TP_ARGS(offset, len),
+	TP_STRUCT__entry(
+		__field(unsigned int, offset)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__entry->offset = offset;
+		__entry->len = len;
+	),
+	TP_printk("offset=%u len=%u", __entry->offset, __entry->len)
+);
+
+#endif /* _LKMC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lkmc_trace
+#include <trace/define_trace.h>
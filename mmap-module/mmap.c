@@ -3,34 +3,1068 @@ Remember: mmap, like most fops, does not work with debugfs as of 4.9! https://pa
 
 Adapted from:
 https://coherentmusings.wordpress.com/2014/06/10/implementing-mmap-for-transferring-data-from-user-space-to-kernel-space/
+
+Tracing: the pr_debug() calls below are off unless enabled through dynamic debug, e.g.
+echo 'module mmap +p' > /sys/kernel/debug/dynamic_debug/control
+Counters are in /sys/kernel/debug/lkmc_mmap/, see lkmc_mmap.h for the format.
+Tracepoints are in the lkmc_mmap trace system, see lkmc_trace.h.
 */
 // #define _GNU_SOURCE             /* Get definition of MSG_EXCEPT */
 // #define __KERNEL__
 // #define MODULE
 // #define __LINUX__
 // #include <asm/uaccess.h> /* copy_from_user */
+#include <linux/anon_inodes.h>
+#include <linux/bvec.h>
+#include <linux/compat.h> /* compat_ptr */
 #include <linux/debugfs.h>
+#include <linux/file.h> /* fd_install */
 #include <linux/fs.h>
+#include <linux/highmem.h> /* kmap_atomic */
 #include <linux/init.h>
 #include <linux/kernel.h> /* min */
+#include <linux/log2.h> /* is_power_of_2 */
+#include <linux/kref.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h> /* lock_page */
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/pipe_fs_i.h>
 #include <linux/proc_fs.h>
+#include <linux/rmap.h> /* page_mkclean */
+#include <linux/rwsem.h>
+#include <linux/sched.h> /* cond_resched */
+#include <linux/sched/isolation.h> /* housekeeping_cpu */
+#include <linux/sched/mm.h> /* mmgrab */
+#include <linux/sched/signal.h> /* rlimit */
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/splice.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+#include <uapi/linux/sched/types.h> /* struct sched_param */
+#endif
+#ifdef CONFIG_X86
+#include <asm/cacheflush.h> /* clflush_cache_range */
+#include <asm/set_memory.h> /* set_pages_array_wc */
+#endif
+
+#include "lkmc_mmap.h"
+#include "lkmc_mpmc.h"
+
+#define CREATE_TRACE_POINTS
+#include "lkmc_trace.h"
 
 static const char *filename = "lkmc_mmap";
 
 enum { BUFFER_SIZE = 4 };
 
+static unsigned long max_size = 64UL << 20;
+module_param(max_size, ulong, 0644);
+MODULE_PARM_DESC(max_size, "Largest named buffer in bytes");
+
+static int consumer_prio;
+module_param(consumer_prio, int, 0644);
+MODULE_PARM_DESC(consumer_prio, "SCHED_FIFO priority of new kernel consumers, 0 for SCHED_NORMAL");
+
+static int consumer_cpu = -1;
+module_param(consumer_cpu, int, 0644);
+MODULE_PARM_DESC(consumer_cpu, "CPU of consumers started without one: -1 any, -2 the first isolated one");
+
+static bool open_stats;
+module_param(open_stats, bool, 0644);
+MODULE_PARM_DESC(open_stats, "Give new opens a debugfs entry under opens/");
+
+struct lkmc_stats {
+	u64 v[LKMC_STAT_NR];
+};
+
+/* Backing pages of one or more opens. Private to its open unless named. */
+struct lkmc_buf {
+	struct kref ref;
+	struct list_head node; /* On bufs if named. */
+	char name[LKMC_NAME_LEN];
+	struct page **pages;
+	unsigned long nr_pages;
+	atomic_t seals; /* LKMC_SEAL_*, never cleared. */
+	struct page *page; /* pages points here for one page buffers. */
+	/* The f_mapping of every file on the buffer, so page_mkclean() finds
+	 * all the mappings of a page through page->mapping. */
+	struct address_space mapping;
+	unsigned long *dirty; /* Bitmap of pages written since LKMC_IOC_GET_DIRTY. */
+	unsigned long *cow; /* Bitmap of pages shared with a snapshot. */
+	atomic_t nr_cow; /* Bits set in cow. */
+	/* Held for write while sharing pages or changing their cache attribute. */
+	struct rw_semaphore snap_lock;
+	enum lkmc_cache cache; /* Of the pages in the kernel direct map. */
+	atomic_t nr_maps; /* Mappings of the buffer, by any open. */
+	/* Live snapshots of this buffer. cow is cleared when the last one goes. */
+	atomic_t nr_snaps;
+	struct lkmc_buf *origin; /* Of a snapshot: the buffer it shares pages with. */
+	unsigned long bitmap_words[2]; /* dirty and cow of small buffers. */
+};
+
+/* User memory registered with LKMC_IOC_PIN. */
+struct lkmc_pinned {
+	struct page **pages;
+	unsigned long nr_pages;
+	unsigned long offset; /* Of the first byte in pages[0]. */
+	size_t len;
+	void *vaddr; /* vmap() of pages, the data starts at vaddr + offset. */
+	struct bio_vec *bvec; /* The same bytes, for block and network consumers. */
+	struct mm_struct *mm; /* Charged with locked pages of locked_vm. */
+	unsigned long locked;
+};
+
+/* One per open. Mappings pin the file through vm_file, so it outlives them. */
 struct mmap_info {
-	char *data;
+	spinlock_t lock; /* Protects buf and map_count against ioctl_attach(). */
+	struct lkmc_buf *buf;
+	atomic_t map_count;
+	enum lkmc_cache cache; /* Of new mappings. */
+	struct mutex pin_lock;
+	struct lkmc_pinned *pinned;
+	struct mutex consumer_lock;
+	struct lkmc_consumer_thread *consumer;
+	struct lkmc_stats __percpu *stats;
+	struct dentry *stats_dentry;
+	struct dentry *stats_bin_dentry;
+};
+
+static LIST_HEAD(bufs);
+static DEFINE_MUTEX(bufs_lock);
+static struct kmem_cache *info_cache;
+static struct kmem_cache *buf_cache;
+
+/* Zeroed pages for new buffers, so that an open does not wait for the page
+ * allocator and memset. Freed pages go to dirty and the refill work zeroes
+ * them off the open path, or allocates new ones. Per CPU, the lock is only
+ * shared with the work. */
+enum { POOL_PAGES = 64 };
+
+struct page_pool {
+	spinlock_t lock;
+	unsigned int nr_clean;
+	unsigned int nr_dirty;
+	struct page *clean[POOL_PAGES];
+	struct page *dirty[POOL_PAGES];
+	struct work_struct refill;
+};
+
+static DEFINE_PER_CPU(struct page_pool, page_pools);
+
+/* Closed opens with their per-CPU counters, so that open() does not go
+ * through alloc_percpu() and its global mutex. Only touched with
+ * preemption disabled on the owning CPU, and at module exit. */
+enum { INFO_POOL = 16 };
+
+struct info_pool {
+	unsigned int nr;
+	struct mmap_info *free[INFO_POOL];
+};
+
+static DEFINE_PER_CPU(struct info_pool, info_pools);
+
+static const char *const stat_names[LKMC_STAT_NR] = {
+	[LKMC_STAT_OPENS] = "opens",
+	[LKMC_STAT_FAULTS] = "faults",
+	[LKMC_STAT_PAGES_MAPPED] = "pages_mapped",
+	[LKMC_STAT_BYTES_READ] = "bytes_read",
+	[LKMC_STAT_BYTES_WRITTEN] = "bytes_written",
+	[LKMC_STAT_SPLICE_PAGES] = "splice_pages",
+	[LKMC_STAT_WAKEUPS] = "wakeups",
+	[LKMC_STAT_FAULT_NS] = "fault_ns",
+	[LKMC_STAT_MMAP_NS] = "mmap_ns",
+	[LKMC_STAT_READ_NS] = "read_ns",
+	[LKMC_STAT_WRITE_NS] = "write_ns",
+	[LKMC_STAT_SPLICE_NS] = "splice_ns",
+	[LKMC_STAT_POOL_HITS] = "pool_hits",
+	[LKMC_STAT_POOL_MISSES] = "pool_misses",
+	[LKMC_STAT_MKWRITES] = "mkwrites",
+	[LKMC_STAT_COW_COPIES] = "cow_copies",
+};
+
+/* Device wide counters, summed over all opens. */
+static DEFINE_PER_CPU(struct lkmc_stats, dev_stats);
+static struct dentry *debugfs_dir;
+static struct dentry *debugfs_opens;
+static atomic_t open_ids = ATOMIC_INIT(0);
+
+/* Account to the device and, if there is one, to the open file. */
+static void stat_add(struct mmap_info *info, enum lkmc_stat idx, u64 val)
+{
+	this_cpu_add(dev_stats.v[idx], val);
+	if (info)
+		this_cpu_add(info->stats->v[idx], val);
+}
+
+static void stats_sum(struct lkmc_stats __percpu *stats, u64 *out)
+{
+	int cpu, i;
+
+	memset(out, 0, sizeof(u64) * LKMC_STAT_NR);
+	for_each_possible_cpu(cpu) {
+		const struct lkmc_stats *s = per_cpu_ptr(stats, cpu);
+
+		for (i = 0; i < LKMC_STAT_NR; i++)
+			out[i] += s->v[i];
+	}
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	u64 sum[LKMC_STAT_NR];
+	int i;
+
+	stats_sum(m->private, sum);
+	for (i = 0; i < LKMC_STAT_NR; i++)
+		seq_printf(m, "%s %llu\n", stat_names[i], (unsigned long long)sum[i]);
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, stats_show, inode->i_private);
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+struct stats_bin {
+	struct lkmc_stats_header hdr;
+	u64 v[LKMC_STAT_NR];
+};
+
+static void stats_bin_fill(struct lkmc_stats __percpu *stats, struct stats_bin *out)
+{
+	out->hdr.magic = LKMC_STATS_MAGIC;
+	out->hdr.version = LKMC_STATS_VERSION;
+	out->hdr.nr = LKMC_STAT_NR;
+	out->hdr.reserved = 0;
+	stats_sum(stats, out->v);
+}
+
+static ssize_t stats_bin_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
+{
+	struct stats_bin out;
+
+	stats_bin_fill(file_inode(filp)->i_private, &out);
+	return simple_read_from_buffer(buf, len, off, &out, sizeof(out));
+}
+
+static const struct file_operations stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = stats_bin_read,
+	.llseek = default_llseek,
+};
+
+static void pool_refill(struct work_struct *work)
+{
+	struct page_pool *pool = container_of(work, struct page_pool, refill);
+	struct page *page;
+
+	for (;;) {
+		page = NULL;
+		spin_lock(&pool->lock);
+		if (pool->nr_clean == POOL_PAGES) {
+			spin_unlock(&pool->lock);
+			return;
+		}
+		if (pool->nr_dirty)
+			page = pool->dirty[--pool->nr_dirty];
+		spin_unlock(&pool->lock);
+		if (page)
+			clear_highpage(page);
+		else
+			page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!page)
+			return;
+		spin_lock(&pool->lock);
+		if (pool->nr_clean < POOL_PAGES) {
+			pool->clean[pool->nr_clean++] = page;
+			page = NULL;
+		}
+		spin_unlock(&pool->lock);
+		if (page) {
+			__free_page(page);
+			return;
+		}
+		cond_resched();
+	}
+}
+
+static struct page *pool_alloc_page(void)
+{
+	struct page_pool *pool;
+	struct page *page = NULL;
+	bool low;
+
+	pool = get_cpu_ptr(&page_pools);
+	spin_lock(&pool->lock);
+	if (pool->nr_clean)
+		page = pool->clean[--pool->nr_clean];
+	low = pool->nr_clean < POOL_PAGES / 2;
+	spin_unlock(&pool->lock);
+	if (low)
+		schedule_work_on(smp_processor_id(), &pool->refill);
+	put_cpu_ptr(&page_pools);
+	if (page) {
+		stat_add(NULL, LKMC_STAT_POOL_HITS, 1);
+		return page;
+	}
+	stat_add(NULL, LKMC_STAT_POOL_MISSES, 1);
+	return alloc_page(GFP_KERNEL | __GFP_ZERO);
+}
+
+static void pool_free_page(struct page *page)
+{
+	struct page_pool *pool;
+
+	pool = get_cpu_ptr(&page_pools);
+	spin_lock(&pool->lock);
+	/* Someone else, e.g. a pipe filled by vmsplice(), may still use it. */
+	if (page_count(page) == 1 && pool->nr_dirty < POOL_PAGES) {
+		pool->dirty[pool->nr_dirty++] = page;
+		page = NULL;
+	}
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(&page_pools);
+	if (page)
+		__free_page(page);
+}
+
+static void pool_init(void)
+{
+	struct page_pool *pool;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(&page_pools, cpu);
+		spin_lock_init(&pool->lock);
+		INIT_WORK(&pool->refill, pool_refill);
+	}
+	for_each_online_cpu(cpu)
+		schedule_work_on(cpu, &per_cpu_ptr(&page_pools, cpu)->refill);
+}
+
+static void pool_exit(void)
+{
+	struct page_pool *pool;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(&page_pools, cpu);
+		cancel_work_sync(&pool->refill);
+		while (pool->nr_clean)
+			__free_page(pool->clean[--pool->nr_clean]);
+		while (pool->nr_dirty)
+			__free_page(pool->dirty[--pool->nr_dirty]);
+	}
+}
+
+/* Mapped pages are dirtied by the fault code, there is no writeback. */
+static const struct address_space_operations buf_aops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	.dirty_folio = noop_dirty_folio,
+#else
+	.set_page_dirty = __set_page_dirty_no_writeback,
+#endif
+};
+
+#ifdef CONFIG_X86
+/* Give the direct map of the pages of buf the cache attribute that user
+ * mappings are about to use: PAT does not allow aliases of a page with
+ * different attributes. Only for pages nobody else holds, e.g. a snapshot
+ * or a pipe. Called with snap_lock held for write, or on the last put. */
+static int buf_set_pages_cache(struct lkmc_buf *buf, enum lkmc_cache cache)
+{
+	unsigned long i;
+	int ret = 0;
+
+	if (cache == buf->cache)
+		return 0;
+	if (cache != LKMC_CACHE_WB) {
+		for (i = 0; i < buf->nr_pages; i++)
+			if (page_count(buf->pages[i]) != 1)
+				return -EBUSY;
+	}
+	/* Through write-back, memtypes cannot be changed in place. */
+	if (buf->cache != LKMC_CACHE_WB) {
+		ret = set_pages_array_wb(buf->pages, buf->nr_pages);
+		if (ret)
+			return ret;
+		buf->cache = LKMC_CACHE_WB;
+	}
+	if (cache == LKMC_CACHE_WC)
+		ret = set_pages_array_wc(buf->pages, buf->nr_pages);
+	else if (cache == LKMC_CACHE_UC)
+		ret = set_pages_array_uc(buf->pages, buf->nr_pages);
+	if (!ret)
+		buf->cache = cache;
+	return ret;
+}
+#else
+/* The direct map cannot follow, only write-back mappings are allowed. */
+static int buf_set_pages_cache(struct lkmc_buf *buf, enum lkmc_cache cache)
+{
+	return cache == LKMC_CACHE_WB ? 0 : -EOPNOTSUPP;
+}
+#endif
+
+static void buf_put(struct lkmc_buf *buf);
+
+/* A snapshot of buf is gone. Once none is left no page is shared with one,
+ * so the next writes need no copy. */
+static void buf_drop_snapshot(struct lkmc_buf *buf)
+{
+	down_write(&buf->snap_lock);
+	if (atomic_dec_and_test(&buf->nr_snaps)) {
+		bitmap_zero(buf->cow, buf->nr_pages);
+		atomic_set(&buf->nr_cow, 0);
+	}
+	up_write(&buf->snap_lock);
+}
+
+static void buf_free(struct lkmc_buf *buf)
+{
+	struct page *page;
+	unsigned long i;
+
+	if (buf->origin)
+		buf_drop_snapshot(buf->origin);
+	/* The pool clears pages through the write-back direct map. */
+	buf_set_pages_cache(buf, LKMC_CACHE_WB);
+	for (i = 0; buf->pages && i < buf->nr_pages; i++) {
+		page = buf->pages[i];
+		if (!page)
+			continue;
+		/* Pages shared with a snapshot belong to the buffer they came from. */
+		if (page->mapping == &buf->mapping)
+			page->mapping = NULL;
+		pool_free_page(page);
+	}
+	if (buf->pages != &buf->page)
+		kvfree(buf->pages);
+	if (buf->dirty != buf->bitmap_words)
+		kvfree(buf->dirty);
+	if (buf->origin)
+		buf_put(buf->origin);
+	kmem_cache_free(buf_cache, buf);
+}
+
+/* A buffer of size bytes without pages yet. */
+static struct lkmc_buf *buf_alloc_empty(const char *name, size_t size)
+{
+	struct lkmc_buf *buf;
+	size_t longs;
+
+	buf = kmem_cache_zalloc(buf_cache, GFP_KERNEL);
+	if (!buf)
+		return NULL;
+	kref_init(&buf->ref);
+	INIT_LIST_HEAD(&buf->node);
+	atomic_set(&buf->seals, 0);
+	atomic_set(&buf->nr_cow, 0);
+	atomic_set(&buf->nr_maps, 0);
+	atomic_set(&buf->nr_snaps, 0);
+	init_rwsem(&buf->snap_lock);
+	strlcpy(buf->name, name, sizeof(buf->name));
+	address_space_init_once(&buf->mapping);
+	buf->mapping.a_ops = &buf_aops;
+	buf->nr_pages = max_t(unsigned long, 1, DIV_ROUND_UP(size, PAGE_SIZE));
+	if (buf->nr_pages == 1)
+		buf->pages = &buf->page;
+	else
+		buf->pages = kvmalloc_array(buf->nr_pages, sizeof(*buf->pages),
+				GFP_KERNEL | __GFP_ZERO);
+	longs = BITS_TO_LONGS(buf->nr_pages);
+	if (longs == 1)
+		buf->dirty = buf->bitmap_words;
+	else
+		buf->dirty = kvzalloc(2 * longs * sizeof(long), GFP_KERNEL);
+	if (!buf->pages || !buf->dirty) {
+		buf_free(buf);
+		return NULL;
+	}
+	buf->cow = buf->dirty + longs;
+	return buf;
+}
+
+static struct lkmc_buf *buf_alloc(const char *name, size_t size)
+{
+	struct lkmc_buf *buf;
+	unsigned long i;
+
+	buf = buf_alloc_empty(name, size);
+	if (!buf)
+		return NULL;
+	for (i = 0; i < buf->nr_pages; i++) {
+		buf->pages[i] = pool_alloc_page();
+		if (!buf->pages[i]) {
+			buf_free(buf);
+			return NULL;
+		}
+		buf->pages[i]->mapping = &buf->mapping;
+		buf->pages[i]->index = i;
+	}
+	return buf;
+}
+
+/* Called with bufs_lock held by kref_put_mutex. */
+static void buf_release(struct kref *ref)
+{
+	struct lkmc_buf *buf = container_of(ref, struct lkmc_buf, ref);
+
+	list_del(&buf->node);
+	mutex_unlock(&bufs_lock);
+	buf_free(buf);
+}
+
+static void buf_put(struct lkmc_buf *buf)
+{
+	kref_put_mutex(&buf->ref, buf_release, &bufs_lock);
+}
+
+/* Reference the named buffer. Called with bufs_lock held. */
+static struct lkmc_buf *buf_lookup(const char *name)
+{
+	struct lkmc_buf *buf;
+
+	list_for_each_entry(buf, &bufs, node) {
+		if (!strcmp(buf->name, name)) {
+			kref_get(&buf->ref);
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+/* Find the named buffer or create it with size bytes. */
+static struct lkmc_buf *buf_get_named(const char *name, size_t size, bool create)
+{
+	struct lkmc_buf *buf, *new;
+
+	mutex_lock(&bufs_lock);
+	buf = buf_lookup(name);
+	mutex_unlock(&bufs_lock);
+	if (buf)
+		return buf;
+	if (!create)
+		return ERR_PTR(-ENOENT);
+
+	/* Allocate unlocked, a large buffer takes a while. */
+	new = buf_alloc(name, size);
+	if (!new)
+		return ERR_PTR(-ENOMEM);
+	mutex_lock(&bufs_lock);
+	buf = buf_lookup(name);
+	if (!buf)
+		list_add(&new->node, &bufs);
+	mutex_unlock(&bufs_lock);
+	if (buf) {
+		buf_free(new);
+		return buf;
+	}
+	return new;
+}
+
+static void *buf_data(struct lkmc_buf *buf)
+{
+	return page_address(READ_ONCE(buf->pages[0]));
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define lkmc_page_mkclean(page) folio_mkclean(page_folio(page))
+#else
+#define lkmc_page_mkclean(page) page_mkclean(page)
+#endif
+
+/* Lock page i of buf. The page lock keeps buf_break_cow() from replacing it. */
+static struct page *buf_lock_page(struct lkmc_buf *buf, unsigned long i)
+{
+	struct page *page;
+
+	for (;;) {
+		page = READ_ONCE(buf->pages[i]);
+		lock_page(page);
+		if (page == READ_ONCE(buf->pages[i]))
+			return page;
+		unlock_page(page);
+	}
+}
+
+/* Give page i of buf its own copy, leaving the shared one to the snapshots,
+ * and zap the mappings of the old page so that they fault the new one. */
+static int buf_break_cow(struct lkmc_buf *buf, unsigned long i)
+{
+	struct page *old, *new;
+
+	new = pool_alloc_page();
+	if (!new)
+		return -ENOMEM;
+	/* Waits for a snapshot in progress. */
+	down_read(&buf->snap_lock);
+	old = buf_lock_page(buf, i);
+	if (!test_bit(i, buf->cow)) {
+		/* Someone else broke it meanwhile. */
+		unlock_page(old);
+		up_read(&buf->snap_lock);
+		pool_free_page(new);
+		return 0;
+	}
+	copy_highpage(new, old);
+	stat_add(NULL, LKMC_STAT_COW_COPIES, 1);
+	new->mapping = &buf->mapping;
+	new->index = i;
+	/* The copy before the pointer, for lockless readers of pages. */
+	smp_store_release(&buf->pages[i], new);
+	clear_bit(i, buf->cow);
+	atomic_dec(&buf->nr_cow);
+	old->mapping = NULL;
+	unlock_page(old);
+	/* Only the shared PTEs: private COW copies keep their writes. */
+	unmap_mapping_range(&buf->mapping, (loff_t)i << PAGE_SHIFT, PAGE_SIZE, 0);
+	up_read(&buf->snap_lock);
+	put_page(old);
+	return 0;
+}
+
+/* Break the COW of every page, for kernel users that write anywhere. */
+static int buf_unshare(struct lkmc_buf *buf)
+{
+	unsigned long i;
+	int ret;
+
+	for_each_set_bit(i, buf->cow, buf->nr_pages) {
+		ret = buf_break_cow(buf, i);
+		if (ret)
+			return ret;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* Kernel address of page i for writing, after breaking its COW.
+ * Kernel writes racing LKMC_IOC_SNAPSHOT may or may not be in the snapshot. */
+static void *buf_write_addr(struct lkmc_buf *buf, unsigned long i)
+{
+	if (test_bit(i, buf->cow) && buf_break_cow(buf, i))
+		return NULL;
+	return page_address(READ_ONCE(buf->pages[i]));
+}
+
+/* Check that [off, off + len) is inside buf. */
+static int buf_range_ok(struct lkmc_buf *buf, u64 off, u64 len)
+{
+	return off + len >= off && off + len <= (u64)buf->nr_pages << PAGE_SHIFT;
+}
+
+/* Account a kernel write to the buffer for LKMC_IOC_GET_DIRTY. */
+static void buf_mark_dirty(struct lkmc_buf *buf, u64 off, u64 len)
+{
+	unsigned long i;
+
+	if (!len)
+		return;
+	/* The data before the bit, for a reader that saw the bit. */
+	smp_mb__before_atomic();
+	for (i = off >> PAGE_SHIFT; i <= (off + len - 1) >> PAGE_SHIFT; i++)
+		set_bit(i, buf->dirty);
+}
+
+/* Copy len bytes between user memory and buf at off, a page at a time.
+ * Return: 0, -EINVAL if the range is outside buf or -EFAULT. */
+static int buf_copy(struct lkmc_buf *buf, u64 off, void __user *ubuf, u64 len, bool to_buf)
+{
+	unsigned long ret;
+	size_t n;
+	char *p;
+
+	if (!buf_range_ok(buf, off, len))
+		return -EINVAL;
+	while (len) {
+		if (to_buf)
+			p = buf_write_addr(buf, off >> PAGE_SHIFT);
+		else
+			p = page_address(READ_ONCE(buf->pages[off >> PAGE_SHIFT]));
+		if (!p)
+			return -ENOMEM;
+		p += offset_in_page(off);
+		n = min_t(u64, len, PAGE_SIZE - offset_in_page(off));
+		if (to_buf) {
+			ret = copy_from_user(p, ubuf, n);
+			buf_mark_dirty(buf, off, n);
+		} else {
+			ret = copy_to_user(ubuf, p, n);
+		}
+		if (ret)
+			return -EFAULT;
+		off += n;
+		ubuf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Write back the cache lines of [off, off + len), as before handing the
+ * bytes to a device or to a non-coherent mapping. */
+static int buf_flush(struct lkmc_buf *buf, u64 off, u64 len)
+{
+	struct page *page;
+	size_t n;
+
+	if (!buf_range_ok(buf, off, len))
+		return -EINVAL;
+	while (len) {
+		page = buf->pages[off >> PAGE_SHIFT];
+		n = min_t(u64, len, PAGE_SIZE - offset_in_page(off));
+#ifdef CONFIG_X86
+		clflush_cache_range((char *)page_address(page) + offset_in_page(off), n);
+#else
+		flush_dcache_page(page);
+#endif
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Reference the current buffer of an open, for users that may sleep. */
+static struct lkmc_buf *info_get_buf(struct mmap_info *info)
+{
+	struct lkmc_buf *buf;
+
+	spin_lock(&info->lock);
+	buf = info->buf;
+	kref_get(&buf->ref);
+	spin_unlock(&info->lock);
+	return buf;
+}
+
+struct lkmc_queue {
+	struct lkmc_buf *buf;
+	struct lkmc_mpmc q;
+};
+
+/* Thread of LKMC_IOC_CONSUMER_START. The counters are only read once it
+ * stopped. */
+struct lkmc_consumer_thread {
+	struct task_struct *task;
+	struct lkmc_queue q;
+	void *msg; /* One slot payload. */
+	int cpu;
+	u32 flags;
+	u64 msgs;
+	u64 bytes;
 };
 
+/* Validate a queue geometry against the buffer it has to fit in. */
+static int mpmc_check(struct lkmc_buf *buf, u64 slot_size, u64 capacity)
+{
+	return lkmc_mpmc_check(slot_size, capacity, (u64)buf->nr_pages << PAGE_SHIFT, PAGE_SIZE);
+}
+
+/* Read and validate the geometry of the queue in buf, which q then uses
+ * with the caller's reference. */
+static int lkmc_queue_init(struct lkmc_queue *q, struct lkmc_buf *buf)
+{
+	struct lkmc_mpmc_hdr *hdr;
+	u32 slot_size;
+	u64 capacity;
+
+	hdr = buf_data(buf);
+	slot_size = READ_ONCE(hdr->slot_size);
+	capacity = READ_ONCE(hdr->capacity);
+	if (smp_load_acquire(&hdr->magic) != LKMC_MPMC_MAGIC ||
+	    mpmc_check(buf, slot_size, capacity))
+		return -EINVAL;
+	q->buf = buf;
+	q->q.hdr = hdr;
+	q->q.pages = buf->pages;
+	q->q.mask = capacity - 1;
+	q->q.slot_size = slot_size;
+	q->q.slots_off = lkmc_mpmc_size(slot_size, capacity) - capacity * slot_size;
+	return 0;
+}
+
+/**
+ * lkmc_queue_get() - attach a kernel thread to a queue in a named buffer
+ * @name: buffer name, as passed to LKMC_IOC_ATTACH
+ *
+ * The buffer must have been formatted with LKMC_IOC_MPMC_INIT. The geometry
+ * is read once and validated, later changes to the header are ignored.
+ *
+ * Return: the queue, ERR_PTR(-ENOENT) or ERR_PTR(-EINVAL) if not a queue.
+ */
+struct lkmc_queue *lkmc_queue_get(const char *name)
+{
+	struct lkmc_queue *q;
+	struct lkmc_buf *buf;
+	int ret;
+
+	mutex_lock(&bufs_lock);
+	buf = buf_lookup(name);
+	mutex_unlock(&bufs_lock);
+	if (!buf)
+		return ERR_PTR(-ENOENT);
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q) {
+		buf_put(buf);
+		return ERR_PTR(-ENOMEM);
+	}
+	ret = lkmc_queue_init(q, buf);
+	if (ret) {
+		kfree(q);
+		buf_put(buf);
+		return ERR_PTR(ret);
+	}
+	return q;
+}
+EXPORT_SYMBOL_GPL(lkmc_queue_get);
+
+void lkmc_queue_put(struct lkmc_queue *q)
+{
+	buf_put(q->buf);
+	kfree(q);
+}
+EXPORT_SYMBOL_GPL(lkmc_queue_put);
+
+/* A snapshot shares the pages until written: take private copies before
+ * writing and follow pages[0] to the current header. May sleep. */
+static int lkmc_queue_prepare(struct lkmc_queue *q)
+{
+	int ret;
+
+	if (atomic_read(&q->buf->nr_cow)) {
+		ret = buf_unshare(q->buf);
+		if (ret)
+			return ret;
+	}
+	q->q.hdr = buf_data(q->buf);
+	return 0;
+}
+
+/* Return: 0, -EAGAIN if the queue is full or busy, -EMSGSIZE if len exceeds a
+ * slot, -ENOMEM. On -EAGAIN the caller should reschedule before retrying. */
+int lkmc_queue_enqueue(struct lkmc_queue *q, const void *data, size_t len)
+{
+	int ret;
+
+	if (len > lkmc_mpmc_payload(&q->q))
+		return -EMSGSIZE;
+	ret = lkmc_queue_prepare(q);
+	if (ret)
+		return ret;
+	return lkmc_mpmc_enqueue(&q->q, data, len);
+}
+EXPORT_SYMBOL_GPL(lkmc_queue_enqueue);
+
+/* Return: the message length (truncated to len), -EAGAIN if the queue is empty
+ * or busy, -ENOMEM. On -EAGAIN the caller should reschedule before retrying. */
+int lkmc_queue_dequeue(struct lkmc_queue *q, void *data, size_t len)
+{
+	int ret;
+
+	ret = lkmc_queue_prepare(q);
+	if (ret)
+		return ret;
+	return lkmc_mpmc_dequeue(&q->q, data, min_t(size_t, len, U32_MAX));
+}
+EXPORT_SYMBOL_GPL(lkmc_queue_dequeue);
+
+/* Empty polls before the consumer sleeps for a tick, so that a producer
+ * placed on the same CPU gets to run. */
+enum { CONSUMER_SPINS = 1000 };
+
+static int consumer_thread(void *data)
+{
+	struct lkmc_consumer_thread *c = data;
+	size_t len = lkmc_mpmc_payload(&c->q.q);
+	unsigned int idle = 0;
+	int ret;
+
+	while (!kthread_should_stop()) {
+		ret = lkmc_queue_dequeue(&c->q, c->msg, len);
+		if (ret >= 0) {
+			c->msgs++;
+			c->bytes += ret;
+			idle = 0;
+			cond_resched();
+		} else if (ret == -EAGAIN && ++idle < CONSUMER_SPINS) {
+			/* Empty, or a mapper keeps the queue looking busy. */
+			cpu_relax();
+			cond_resched();
+		} else {
+			idle = 0;
+			schedule_timeout_interruptible(1);
+			stat_add(NULL, LKMC_STAT_WAKEUPS, 1);
+		}
+	}
+	return 0;
+}
+
+/* LKMC_CONSUMER_PINGPONG: answer odd values of the first word of the
+ * buffer, the line user space bounces against this CPU. */
+static int pingpong_thread(void *data)
+{
+	struct lkmc_consumer_thread *c = data;
+	struct lkmc_buf *buf = c->q.buf;
+	unsigned int idle = 0;
+	u64 *line, v;
+
+	while (!kthread_should_stop()) {
+		/* Never write into a page shared with a snapshot. */
+		if (atomic_read(&buf->nr_cow) && buf_unshare(buf)) {
+			schedule_timeout_interruptible(1);
+			continue;
+		}
+		line = buf_data(buf);
+		v = smp_load_acquire(line);
+		if (v & 1) {
+			smp_store_release(line, v + 1);
+			c->msgs++;
+			idle = 0;
+		} else if (++idle < CONSUMER_SPINS) {
+			cpu_relax();
+		} else {
+			idle = 0;
+			schedule_timeout_interruptible(1);
+			stat_add(NULL, LKMC_STAT_WAKEUPS, 1);
+		}
+	}
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define LKMC_HK_DOMAIN HK_TYPE_DOMAIN
+#define LKMC_HK_TICK HK_TYPE_TICK
+#else
+#define LKMC_HK_DOMAIN HK_FLAG_DOMAIN
+#define LKMC_HK_TICK HK_FLAG_TICK
+#endif
+
+/* A CPU taken out of the scheduler domains (isolcpus=) or of the tick
+ * (nohz_full=), where a benchmark thread sees the least jitter. */
+static bool lkmc_cpu_isolated(int cpu)
+{
+	return !housekeeping_cpu(cpu, LKMC_HK_DOMAIN) || !housekeeping_cpu(cpu, LKMC_HK_TICK);
+}
+
+/* @return the first online isolated CPU, -1 if there is none */
+static int lkmc_isolated_cpu(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		if (lkmc_cpu_isolated(cpu))
+			return cpu;
+	return -1;
+}
+
+/* Run p under SCHED_FIFO at prio, or SCHED_NORMAL for 0. Since 5.9 modules
+ * can only choose between the lowest FIFO priority, for prio 1, and the
+ * default one, MAX_RT_PRIO / 2, for any other. */
+static int lkmc_set_prio(struct task_struct *p, int prio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	if (prio <= 0)
+		sched_set_normal(p, 0);
+	else if (prio == 1)
+		sched_set_fifo_low(p);
+	else
+		sched_set_fifo(p);
+	return 0;
+#else
+	struct sched_param sp = { .sched_priority = clamp(prio, 0, MAX_RT_PRIO - 1) };
+
+	return sched_setscheduler_nocheck(p, prio > 0 ? SCHED_FIFO : SCHED_NORMAL, &sp);
+#endif
+}
+
+/* Takes over the caller's reference to buf. */
+static struct lkmc_consumer_thread *consumer_start(struct lkmc_buf *buf, int cpu, u32 flags)
+{
+	struct lkmc_consumer_thread *c;
+	int prio, ret;
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c) {
+		buf_put(buf);
+		return ERR_PTR(-ENOMEM);
+	}
+	if (flags & LKMC_CONSUMER_PINGPONG) {
+		c->q.buf = buf;
+		c->task = kthread_create(pingpong_thread, c, "lkmc_pingpong/%d", cpu);
+	} else {
+		ret = lkmc_queue_init(&c->q, buf);
+		if (ret)
+			goto err;
+		ret = -ENOMEM;
+		c->msg = kmalloc(lkmc_mpmc_payload(&c->q.q), GFP_KERNEL);
+		if (!c->msg)
+			goto err;
+		c->task = kthread_create(consumer_thread, c, "lkmc_consumer/%d", cpu);
+	}
+	if (IS_ERR(c->task)) {
+		ret = PTR_ERR(c->task);
+		goto err;
+	}
+	c->cpu = cpu;
+	c->flags = flags;
+	if (cpu >= 0)
+		kthread_bind(c->task, cpu);
+	prio = READ_ONCE(consumer_prio);
+	ret = lkmc_set_prio(c->task, prio);
+	if (ret)
+		pr_warn("lkmc_mmap: consumer priority %d: %d\n", prio, ret);
+	wake_up_process(c->task);
+	return c;
+err:
+	kfree(c->msg);
+	kfree(c);
+	buf_put(buf);
+	return ERR_PTR(ret);
+}
+
+/* Stop and free c, reporting its counters in out unless NULL. */
+static void consumer_stop(struct lkmc_consumer_thread *c, struct lkmc_consumer *out)
+{
+	kthread_stop(c->task);
+	if (out) {
+		out->cpu = c->cpu;
+		out->flags = c->flags;
+		out->msgs = c->msgs;
+		out->bytes = c->bytes;
+	}
+	kfree(c->msg);
+	buf_put(c->q.buf);
+	kfree(c);
+}
+
 /* After unmap. */
 static void vm_close(struct vm_area_struct *vma)
 {
-	pr_info("vm_close\n");
+	struct mmap_info *info = vma->vm_private_data;
+
+	pr_debug("vm_close\n");
+	/* info->buf cannot change while map_count is held. */
+	atomic_dec(&info->buf->nr_maps);
+	atomic_dec(&info->map_count);
 }
 
 /* First page access. */
@@ -39,101 +1073,1082 @@ static int vm_fault(struct vm_fault *vmf)
 {
 	struct page *page;
 	struct mmap_info *info;
+	int ret = 0;
+	u64 start = ktime_get_ns();
+	u64 ns;
 
-	pr_info("vm_fault\n");
+	pr_debug("vm_fault\n");
 	info = (struct mmap_info *)vmf->vma->vm_private_data;
-	if (info->data) {
-		page = virt_to_page(info->data);
+	stat_add(info, LKMC_STAT_FAULTS, 1);
+	/* info->buf cannot change while mapped, see ioctl_attach(). */
+	if (vmf->pgoff < info->buf->nr_pages) {
+		/* Locked until mapped, so buf_break_cow() zaps it after. */
+		page = buf_lock_page(info->buf, vmf->pgoff);
 		get_page(page);
 		vmf->page = page;
+		ret = VM_FAULT_LOCKED;
+		stat_add(info, LKMC_STAT_PAGES_MAPPED, 1);
+	} else {
+		ret = VM_FAULT_SIGBUS;
 	}
-	return 0;
+	ns = ktime_get_ns() - start;
+	stat_add(info, LKMC_STAT_FAULT_NS, ns);
+	trace_lkmc_fault(vmf->address, vmf->pgoff, ret, ns);
+	return ret;
+}
+
+/* First write to a page since it was last reported by LKMC_IOC_GET_DIRTY or
+ * shared with a snapshot. The page stays locked until its PTE is writable,
+ * see ioctl_get_dirty() and ioctl_snapshot(). */
+static int vm_page_mkwrite(struct vm_fault *vmf)
+{
+	struct mmap_info *info = vmf->vma->vm_private_data;
+	struct lkmc_buf *buf = info->buf;
+	struct page *page = vmf->page;
+
+	pr_debug("vm_page_mkwrite\n");
+	stat_add(info, LKMC_STAT_MKWRITES, 1);
+	lock_page(page);
+	if (page != READ_ONCE(buf->pages[vmf->pgoff])) {
+		/* Replaced by buf_break_cow(), which zaps this PTE. */
+		unlock_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+	if (test_bit(vmf->pgoff, buf->cow)) {
+		unlock_page(page);
+		/* Fault again, on the copy. */
+		return buf_break_cow(buf, vmf->pgoff) ? VM_FAULT_OOM : VM_FAULT_NOPAGE;
+	}
+	set_bit(vmf->pgoff, buf->dirty);
+	return VM_FAULT_LOCKED;
 }
 
 /* Aftr mmap. TODO vs mmap, when can this happen at a different time than mmap? */
 static void vm_open(struct vm_area_struct *vma)
 {
-	pr_info("vm_open\n");
+	struct mmap_info *info = vma->vm_private_data;
+
+	pr_debug("vm_open\n");
+	atomic_inc(&info->map_count);
+	atomic_inc(&info->buf->nr_maps);
 }
 
 static struct vm_operations_struct vm_ops = {
 	.close = vm_close,
 	.open = vm_open,
 	.fault = vm_fault,
+	.page_mkwrite = vm_page_mkwrite,
 };
 
+/* Switch buf to the cache attribute of a new mapping if nothing maps it,
+ * and count the mapping in nr_maps until its vm_open(). */
+static int buf_map_cache(struct lkmc_buf *buf, enum lkmc_cache cache)
+{
+	int ret = 0;
+
+	down_write(&buf->snap_lock);
+	if (cache != buf->cache)
+		ret = atomic_read(&buf->nr_maps) || atomic_read(&buf->nr_cow) ?
+			-EBUSY : buf_set_pages_cache(buf, cache);
+	if (!ret)
+		atomic_inc(&buf->nr_maps);
+	up_write(&buf->snap_lock);
+	return ret;
+}
+
 static int mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	pr_info("mmap\n");
+	struct mmap_info *info = filp->private_data;
+	enum lkmc_cache cache = READ_ONCE(info->cache);
+	struct lkmc_buf *buf;
+	int ret = 0;
+	u64 start = ktime_get_ns();
+	u64 ns;
+
+	pr_debug("mmap\n");
+	buf = info_get_buf(info);
+	ret = buf_map_cache(buf, cache);
+	if (ret)
+		goto put;
+	spin_lock(&info->lock);
+	if (info->buf != buf) {
+		/* Attached to another buffer meanwhile. */
+		ret = -EBUSY;
+		goto out;
+	}
+	if (vma->vm_pgoff + vma_pages(vma) > info->buf->nr_pages) {
+		ret = -EINVAL;
+		goto out;
+	}
+	switch (cache) {
+	case LKMC_CACHE_WC:
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+		break;
+	case LKMC_CACHE_UC:
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+		break;
+	default:
+		break;
+	}
 	vma->vm_ops = &vm_ops;
 	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_private_data = info;
 	vm_open(vma);
-	return 0;
+out:
+	spin_unlock(&info->lock);
+	atomic_dec(&buf->nr_maps);
+put:
+	buf_put(buf);
+	ns = ktime_get_ns() - start;
+	stat_add(info, LKMC_STAT_MMAP_NS, ns);
+	trace_lkmc_mmap(vma->vm_start, vma->vm_end - vma->vm_start, vma->vm_pgoff, ns);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#define lkmc_pin_user_pages(start, nr, pages) \
+	pin_user_pages_fast(start, nr, FOLL_WRITE | FOLL_LONGTERM, pages)
+#define lkmc_unpin_user_pages(pages, nr) unpin_user_pages(pages, nr)
+#else
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+#define lkmc_pin_user_pages(start, nr, pages) \
+	get_user_pages_fast(start, nr, FOLL_WRITE, pages)
+#else
+#define lkmc_pin_user_pages(start, nr, pages) \
+	get_user_pages_fast(start, nr, 1, pages)
+#endif
+static void lkmc_unpin_user_pages(struct page **pages, unsigned long nr)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr; i++)
+		put_page(pages[i]);
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0)
+#define lkmc_account_locked_vm(mm, pages, inc) account_locked_vm(mm, pages, inc)
+#else
+/* account_locked_vm() of 5.3. */
+static int lkmc_account_locked_vm(struct mm_struct *mm, unsigned long pages, bool inc)
+{
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	int ret = 0;
+
+	down_write(&mm->mmap_sem);
+	if (!inc)
+		mm->locked_vm -= min(pages, mm->locked_vm);
+	else if (mm->locked_vm + pages > limit && !capable(CAP_IPC_LOCK))
+		ret = -ENOMEM;
+	else
+		mm->locked_vm += pages;
+	up_write(&mm->mmap_sem);
+	return ret;
+}
+#endif
+
+static void pinned_free(struct lkmc_pinned *p)
+{
+	if (!p)
+		return;
+	if (p->vaddr)
+		vunmap(p->vaddr);
+	kvfree(p->bvec);
+	lkmc_unpin_user_pages(p->pages, p->nr_pages);
+	kvfree(p->pages);
+	/* Maybe from another process than the pinning one, e.g. on close. */
+	if (p->locked)
+		lkmc_account_locked_vm(p->mm, p->locked, false);
+	if (p->mm)
+		mmdrop(p->mm);
+	kfree(p);
+}
+
+static struct lkmc_pinned *pinned_alloc(unsigned long addr, size_t len)
+{
+	struct lkmc_pinned *p;
+	unsigned long i;
+	size_t left;
+	int ret;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return ERR_PTR(-ENOMEM);
+	p->offset = offset_in_page(addr);
+	p->len = len;
+	p->nr_pages = DIV_ROUND_UP(p->offset + len, PAGE_SIZE);
+	p->pages = kvmalloc_array(p->nr_pages, sizeof(*p->pages), GFP_KERNEL);
+	p->bvec = kvmalloc_array(p->nr_pages, sizeof(*p->bvec), GFP_KERNEL);
+	if (!p->pages || !p->bvec) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	/* Long term pins are mlock()ed memory: RLIMIT_MEMLOCK bounds them. */
+	mmgrab(current->mm);
+	p->mm = current->mm;
+	ret = lkmc_account_locked_vm(p->mm, p->nr_pages, true);
+	if (ret)
+		goto err;
+	p->locked = p->nr_pages;
+	ret = lkmc_pin_user_pages(addr & PAGE_MASK, p->nr_pages, p->pages);
+	if (ret != p->nr_pages) {
+		/* Release what a partial pin got, then fail. */
+		p->nr_pages = ret > 0 ? ret : 0;
+		ret = ret < 0 ? ret : -EFAULT;
+		goto err;
+	}
+	p->vaddr = vmap(p->pages, p->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!p->vaddr) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	left = len;
+	for (i = 0; i < p->nr_pages; i++) {
+		p->bvec[i].bv_page = p->pages[i];
+		p->bvec[i].bv_offset = i ? 0 : p->offset;
+		p->bvec[i].bv_len = min_t(size_t, left, PAGE_SIZE - p->bvec[i].bv_offset);
+		left -= p->bvec[i].bv_len;
+	}
+	return p;
+err:
+	pinned_free(p);
+	return ERR_PTR(ret);
+}
+
+static struct mmap_info *info_pool_get(void)
+{
+	struct info_pool *pool;
+	struct mmap_info *info = NULL;
+
+	pool = get_cpu_ptr(&info_pools);
+	if (pool->nr)
+		info = pool->free[--pool->nr];
+	put_cpu_ptr(&info_pools);
+	return info;
+}
+
+/* Return: false if the pool of this CPU is full. */
+static bool info_pool_put(struct mmap_info *info)
+{
+	struct info_pool *pool;
+	bool ret = false;
+
+	pool = get_cpu_ptr(&info_pools);
+	if (pool->nr < INFO_POOL) {
+		pool->free[pool->nr++] = info;
+		ret = true;
+	}
+	put_cpu_ptr(&info_pools);
+	return ret;
+}
+
+static void info_pool_exit(void)
+{
+	struct info_pool *pool;
+	struct mmap_info *info;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(&info_pools, cpu);
+		while (pool->nr) {
+			info = pool->free[--pool->nr];
+			free_percpu(info->stats);
+			kmem_cache_free(info_cache, info);
+		}
+	}
+}
+
+/* New open of buf, taking over the caller's reference. */
+static struct mmap_info *info_alloc(struct lkmc_buf *buf)
+{
+	struct lkmc_stats __percpu *stats;
+	struct mmap_info *info;
+	char name[16];
+	int cpu;
+
+	info = info_pool_get();
+	if (info) {
+		stats = info->stats;
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(stats, cpu), 0, sizeof(struct lkmc_stats));
+	} else {
+		info = kmem_cache_alloc(info_cache, GFP_KERNEL);
+		if (!info)
+			return NULL;
+		stats = alloc_percpu(struct lkmc_stats);
+		if (!stats) {
+			kmem_cache_free(info_cache, info);
+			return NULL;
+		}
+	}
+	memset(info, 0, sizeof(*info));
+	pr_debug("virt_to_phys = 0x%llx\n", (unsigned long long)virt_to_phys((void *)info));
+	info->stats = stats;
+	info->buf = buf;
+	spin_lock_init(&info->lock);
+	mutex_init(&info->pin_lock);
+	mutex_init(&info->consumer_lock);
+	atomic_set(&info->map_count, 0);
+	/* debugfs is best effort: a missing entry only costs observability.
+	 * Opt-in, two dentries per open would dominate a setup churn. */
+	if (READ_ONCE(open_stats)) {
+		snprintf(name, sizeof(name), "%u", atomic_inc_return(&open_ids));
+		info->stats_dentry = debugfs_create_file(name, 0444, debugfs_opens,
+				(void __force *)info->stats, &stats_fops);
+		strlcat(name, ".bin", sizeof(name));
+		info->stats_bin_dentry = debugfs_create_file(name, 0444, debugfs_opens,
+				(void __force *)info->stats, &stats_bin_fops);
+	}
+	stat_add(info, LKMC_STAT_OPENS, 1);
+	return info;
+}
+
+static void info_free(struct mmap_info *info)
+{
+	if (info->consumer)
+		consumer_stop(info->consumer, NULL);
+	/* Waits for in flight debugfs readers of info->stats. */
+	debugfs_remove(info->stats_bin_dentry);
+	debugfs_remove(info->stats_dentry);
+	pinned_free(info->pinned);
+	buf_put(info->buf);
+	if (info_pool_put(info))
+		return;
+	free_percpu(info->stats);
+	kmem_cache_free(info_cache, info);
 }
 
 static int open(struct inode *inode, struct file *filp)
 {
 	struct mmap_info *info;
+	struct lkmc_buf *buf;
 
-	pr_info("open\n");
-	info = kmalloc(sizeof(struct mmap_info), GFP_KERNEL);
-	pr_info("virt_to_phys = 0x%llx\n", (unsigned long long)virt_to_phys((void *)info));
-	info->data = (char *)get_zeroed_page(GFP_KERNEL);
-	memcpy(info->data, "asdf", BUFFER_SIZE);
+	pr_debug("open\n");
+	buf = buf_alloc("", PAGE_SIZE);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf_data(buf), "asdf", BUFFER_SIZE);
+	info = info_alloc(buf);
+	if (!info) {
+		buf_free(buf);
+		return -ENOMEM;
+	}
 	filp->private_data = info;
+	filp->f_mapping = &buf->mapping;
 	return 0;
 }
 
+/* read() and write() ignore the file position: every call copies between
+ * the start of the buffer and the user buffer, up to the buffer size. */
 static ssize_t read(struct file *filp, char __user *buf, size_t len, loff_t *off)
 {
 	struct mmap_info *info;
-    int ret;
+	struct lkmc_buf *b;
+	ssize_t ret;
+	size_t n;
+	u64 start;
+	u64 ns;
 
-	pr_info("read\n");
+	/* Fast path, no clock, stats or trace: only the cost of the syscall. */
+	if (!len)
+		return 0;
+	start = ktime_get_ns();
+	pr_debug("read\n");
 	info = filp->private_data;
-    ret = min(len, (size_t)BUFFER_SIZE);
-    if (copy_to_user(buf, info->data, ret)) {
-        ret = -EFAULT;
+	b = info_get_buf(info);
+	n = min_t(u64, len, (u64)b->nr_pages << PAGE_SHIFT);
+	ret = buf_copy(b, 0, buf, n, false);
+	if (!ret) {
+		ret = n;
+		stat_add(info, LKMC_STAT_BYTES_READ, n);
 	}
+	buf_put(b);
+	ns = ktime_get_ns() - start;
+	stat_add(info, LKMC_STAT_READ_NS, ns);
+	trace_lkmc_read(len, *off, ret, ns);
 	return ret;
 }
 
 static ssize_t write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
 {
 	struct mmap_info *info;
+	struct lkmc_buf *b;
+	ssize_t ret;
+	size_t n;
+	u64 start = ktime_get_ns();
+	u64 ns;
 
-	pr_info("write\n");
+	pr_debug("write\n");
 	info = filp->private_data;
-    if (copy_from_user(info->data, buf, min(len, (size_t)BUFFER_SIZE))) {
-        return -EFAULT;
-    } else {
-        return len;
-    }
+	b = info_get_buf(info);
+	n = min_t(u64, len, (u64)b->nr_pages << PAGE_SHIFT);
+	ret = buf_copy(b, 0, (void __user *)buf, n, true);
+	if (!ret) {
+		ret = len;
+		stat_add(info, LKMC_STAT_BYTES_WRITTEN, n);
+	}
+	buf_put(b);
+	ns = ktime_get_ns() - start;
+	stat_add(info, LKMC_STAT_WRITE_NS, ns);
+	trace_lkmc_write(len, *off, ret, ns);
+	return ret;
+}
+
+struct splice_target {
+	struct mmap_info *info;
+	struct lkmc_buf *buf;
+};
+
+/* Like write(), every pipe buffer lands at the start of the page. */
+static int splice_actor(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+		struct splice_desc *sd)
+{
+	struct splice_target *t = sd->u.data;
+	struct mmap_info *info = t->info;
+	size_t n = min_t(size_t, sd->len, PAGE_SIZE);
+	char *src, *dst;
+
+	dst = buf_write_addr(t->buf, 0);
+	if (!dst)
+		return -ENOMEM;
+	src = kmap_atomic(buf->page);
+	memcpy(dst, src + buf->offset, n);
+	kunmap_atomic(src);
+	buf_mark_dirty(t->buf, 0, n);
+	stat_add(info, LKMC_STAT_BYTES_WRITTEN, n);
+	stat_add(info, LKMC_STAT_SPLICE_PAGES, 1);
+	trace_lkmc_splice_page(buf->offset, sd->len);
+	return sd->len;
+}
+
+static ssize_t splice_write(struct pipe_inode_info *pipe, struct file *out,
+		loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct mmap_info *info = out->private_data;
+	struct splice_target t = { .info = info };
+	struct splice_desc sd = {
+		.total_len = len,
+		.flags = flags,
+		.pos = *ppos,
+		.u.data = &t,
+	};
+	ssize_t ret;
+	loff_t pos = *ppos;
+	u64 start = ktime_get_ns();
+	u64 ns;
+
+	pr_debug("splice_write\n");
+	t.buf = info_get_buf(info);
+	/* splice_from_pipe() without fixing u.file as the actor's argument. */
+	pipe_lock(pipe);
+	ret = __splice_from_pipe(pipe, &sd, splice_actor);
+	pipe_unlock(pipe);
+	if (ret > 0)
+		*ppos += ret;
+	buf_put(t.buf);
+	ns = ktime_get_ns() - start;
+	stat_add(info, LKMC_STAT_SPLICE_NS, ns);
+	trace_lkmc_splice(len, pos, ret, ns);
+	return ret;
 }
 
 static int release(struct inode *inode, struct file *filp)
 {
 	struct mmap_info *info;
 
-	pr_info("release\n");
+	pr_debug("release\n");
 	info = filp->private_data;
-	free_page((unsigned long)info->data);
-	kfree(info);
+	info_free(info);
 	filp->private_data = NULL;
 	return 0;
 }
 
+static long ioctl_pin(struct mmap_info *info, void __user *argp)
+{
+	struct lkmc_pin arg;
+	struct lkmc_pinned *p, *old;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	if (!arg.len || arg.len > max_size || arg.addr + arg.len < arg.addr)
+		return -EINVAL;
+	p = pinned_alloc(arg.addr, arg.len);
+	if (IS_ERR(p))
+		return PTR_ERR(p);
+	mutex_lock(&info->pin_lock);
+	old = info->pinned;
+	info->pinned = p;
+	mutex_unlock(&info->pin_lock);
+	pinned_free(old);
+	return 0;
+}
+
+static long ioctl_unpin(struct mmap_info *info)
+{
+	struct lkmc_pinned *old;
+
+	mutex_lock(&info->pin_lock);
+	old = info->pinned;
+	info->pinned = NULL;
+	mutex_unlock(&info->pin_lock);
+	if (!old)
+		return -EINVAL;
+	pinned_free(old);
+	return 0;
+}
+
+/* The bytes are in the buffer already, only check and account them. */
+static long ioctl_doorbell(struct mmap_info *info, unsigned long len)
+{
+	u64 size;
+
+	spin_lock(&info->lock);
+	size = (u64)info->buf->nr_pages << PAGE_SHIFT;
+	spin_unlock(&info->lock);
+	if (len > size)
+		return -EINVAL;
+	stat_add(info, LKMC_STAT_WAKEUPS, 1);
+	return 0;
+}
+
+static long ioctl_consumer_start(struct mmap_info *info, struct lkmc_consumer __user *argp)
+{
+	struct lkmc_consumer arg;
+	struct lkmc_consumer_thread *c;
+	long ret = 0;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	if (arg.cpu == -1) {
+		arg.cpu = READ_ONCE(consumer_cpu);
+		if (arg.cpu == -2)
+			arg.cpu = lkmc_isolated_cpu();
+		else if (arg.cpu < -1)
+			arg.cpu = -1;
+	}
+	if ((arg.flags & ~LKMC_CONSUMER_PINGPONG) || arg.cpu < -1 || arg.cpu >= (s32)nr_cpu_ids ||
+	    (arg.cpu >= 0 && !cpu_online(arg.cpu)))
+		return -EINVAL;
+	mutex_lock(&info->consumer_lock);
+	if (info->consumer) {
+		ret = -EBUSY;
+		goto out;
+	}
+	c = consumer_start(info_get_buf(info), arg.cpu, arg.flags);
+	if (IS_ERR(c))
+		ret = PTR_ERR(c);
+	else
+		info->consumer = c;
+out:
+	mutex_unlock(&info->consumer_lock);
+	return ret;
+}
+
+static long ioctl_consumer_stop(struct mmap_info *info, struct lkmc_consumer __user *argp)
+{
+	struct lkmc_consumer arg;
+	struct lkmc_consumer_thread *c;
+
+	mutex_lock(&info->consumer_lock);
+	c = info->consumer;
+	info->consumer = NULL;
+	mutex_unlock(&info->consumer_lock);
+	if (!c)
+		return -EINVAL;
+	memset(&arg, 0, sizeof(arg));
+	consumer_stop(c, &arg);
+	if (copy_to_user(argp, &arg, sizeof(arg)))
+		return -EFAULT;
+	return 0;
+}
+
+/* A minimal kernel consumer: reads the pinned bytes in place. */
+static long ioctl_pin_sum(struct mmap_info *info, u64 __user *argp)
+{
+	const u8 *data;
+	u64 sum = 0;
+	size_t i;
+
+	mutex_lock(&info->pin_lock);
+	if (!info->pinned) {
+		mutex_unlock(&info->pin_lock);
+		return -EINVAL;
+	}
+	data = info->pinned->vaddr + info->pinned->offset;
+	for (i = 0; i < info->pinned->len; i++) {
+		sum += data[i];
+		if (!(i & (SZ_1M - 1)))
+			cond_resched();
+	}
+	mutex_unlock(&info->pin_lock);
+	return put_user(sum, argp);
+}
+
+static long ioctl_attach(struct file *filp, struct mmap_info *info, void __user *argp)
+{
+	struct lkmc_attach arg;
+	struct lkmc_buf *buf, *old;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	arg.name[LKMC_NAME_LEN - 1] = '\0';
+	if (!arg.name[0] || arg.size > max_size)
+		return -EINVAL;
+	/* Only writers may create, readers attach to what exists. */
+	buf = buf_get_named(arg.name, arg.size, filp->f_mode & FMODE_WRITE);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	if (arg.size > buf->nr_pages << PAGE_SHIFT) {
+		/* Someone else created it smaller. */
+		buf_put(buf);
+		return -EINVAL;
+	}
+	spin_lock(&info->lock);
+	/* Mappings keep faulting info->buf, it must not change under them. */
+	if (atomic_read(&info->map_count)) {
+		spin_unlock(&info->lock);
+		buf_put(buf);
+		return -EBUSY;
+	}
+	old = info->buf;
+	info->buf = buf;
+	filp->f_mapping = &buf->mapping;
+	spin_unlock(&info->lock);
+	buf_put(old);
+	return 0;
+}
+
+static long ioctl_mpmc_init(struct mmap_info *info, void __user *argp)
+{
+	struct lkmc_mpmc_init arg;
+	struct lkmc_mpmc q;
+	struct lkmc_buf *buf;
+	int ret;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	buf = info_get_buf(info);
+	ret = mpmc_check(buf, arg.slot_size, arg.capacity);
+	if (!ret)
+		ret = buf_unshare(buf);
+	if (!ret) {
+		q.pages = buf->pages;
+		lkmc_mpmc_format(&q, buf_data(buf), arg.slot_size, arg.capacity);
+	}
+	buf_put(buf);
+	return ret;
+}
+
+static const struct file_operations fops;
+
+/* Open a new file on buf, taking over the caller's reference, and install
+ * it as an fd, stored to *fdp. */
+static long buf_install_fd(struct lkmc_buf *buf, int flags, __s32 __user *fdp)
+{
+	struct mmap_info *new;
+	struct file *file;
+	int fd;
+
+	new = info_alloc(buf);
+	if (!new) {
+		buf_put(buf);
+		return -ENOMEM;
+	}
+	fd = get_unused_fd_flags(flags);
+	if (fd < 0) {
+		info_free(new);
+		return fd;
+	}
+	file = anon_inode_getfile("[lkmc_mmap]", &fops, new, flags);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		info_free(new);
+		return PTR_ERR(file);
+	}
+	file->f_mapping = &buf->mapping;
+	/* Nothing can fail once the fd is visible. */
+	if (put_user(fd, fdp)) {
+		fput(file);
+		put_unused_fd(fd);
+		return -EFAULT;
+	}
+	fd_install(fd, file);
+	return 0;
+}
+
+static long ioctl_export(struct file *filp, struct mmap_info *info,
+		struct lkmc_export __user *argp)
+{
+	struct lkmc_export arg;
+	struct lkmc_buf *buf;
+	int flags;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~LKMC_EXPORT_RDONLY || arg.seals & ~LKMC_SEAL_ALL)
+		return -EINVAL;
+	/* A reader, e.g. a snapshot, must not hand out more than it has. */
+	if (!(filp->f_mode & FMODE_WRITE) &&
+	    (!(arg.flags & LKMC_EXPORT_RDONLY) || arg.seals))
+		return -EBADF;
+	flags = (arg.flags & LKMC_EXPORT_RDONLY ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+	buf = info_get_buf(info);
+	atomic_or(arg.seals, &buf->seals);
+	return buf_install_fd(buf, flags, &argp->fd);
+}
+
+/* Share every page of the current buffer with a new read-only buffer. The
+ * live buffer copies a page when it next writes it, see buf_break_cow().
+ * Writers of pages already shared wait for the end of the pass, so the
+ * snapshot is a consistent cut of the writes, not a page by page mix. */
+static long ioctl_snapshot(struct mmap_info *info, struct lkmc_snapshot __user *argp)
+{
+	struct lkmc_buf *buf, *snap;
+	struct page *page;
+	unsigned long i;
+
+	buf = info_get_buf(info);
+	snap = buf_alloc_empty("", (size_t)buf->nr_pages << PAGE_SHIFT);
+	if (!snap) {
+		buf_put(buf);
+		return -ENOMEM;
+	}
+	atomic_set(&snap->seals, LKMC_SEAL_ALL);
+	down_write(&buf->snap_lock);
+	/* The snapshot maps its pages write-back. */
+	if (buf->cache != LKMC_CACHE_WB) {
+		up_write(&buf->snap_lock);
+		buf_put(buf);
+		buf_free(snap);
+		return -EBUSY;
+	}
+	for (i = 0; i < buf->nr_pages; i++) {
+		page = buf_lock_page(buf, i);
+		get_page(page);
+		snap->pages[i] = page;
+		if (!test_and_set_bit(i, buf->cow))
+			atomic_inc(&buf->nr_cow);
+		/* The next write through a mapping faults into vm_page_mkwrite(). */
+		lkmc_page_mkclean(page);
+		unlock_page(page);
+		cond_resched();
+	}
+	/* Takes over the reference of info_get_buf(). */
+	snap->origin = buf;
+	atomic_inc(&buf->nr_snaps);
+	up_write(&buf->snap_lock);
+	return buf_install_fd(snap, O_RDONLY | O_CLOEXEC, &argp->fd);
+}
+
+static long ioctl_buf_info(struct mmap_info *info, void __user *argp)
+{
+	struct lkmc_buf_info arg;
+	struct lkmc_buf *buf;
+
+	memset(&arg, 0, sizeof(arg));
+	buf = info_get_buf(info);
+	arg.size = (u64)buf->nr_pages << PAGE_SHIFT;
+	arg.seals = atomic_read(&buf->seals);
+	buf_put(buf);
+	return copy_to_user(argp, &arg, sizeof(arg)) ? -EFAULT : 0;
+}
+
+/* Replace the buffer of the open by one of size bytes with the same name
+ * and contents, truncated or zero extended. Only when no mapping, other
+ * open or exported fd can see the pages: they are not moved in place. */
+static long buf_resize(struct file *filp, struct mmap_info *info, u64 size)
+{
+	struct lkmc_buf *old, *new;
+	unsigned long i;
+	long ret = 0;
+
+	if (size > max_size)
+		return -EINVAL;
+	old = info_get_buf(info);
+	if (atomic_read(&old->seals) & LKMC_SEAL_RESIZE) {
+		ret = -EPERM;
+		goto out;
+	}
+	new = buf_alloc(old->name, size);
+	if (!new) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < min(old->nr_pages, new->nr_pages); i++)
+		copy_page(page_address(new->pages[i]), page_address(old->pages[i]));
+	/* bufs_lock keeps buf_lookup() from handing out old meanwhile. */
+	mutex_lock(&bufs_lock);
+	spin_lock(&info->lock);
+	/* Two references: the open's and ours. */
+	if (info->buf != old || atomic_read(&info->map_count) ||
+	    kref_read(&old->ref) != 2) {
+		ret = -EBUSY;
+	} else if (atomic_read(&old->seals) & LKMC_SEAL_RESIZE) {
+		ret = -EPERM;
+	} else {
+		info->buf = new;
+		filp->f_mapping = &new->mapping;
+		if (!list_empty(&old->node))
+			list_replace_init(&old->node, &new->node);
+	}
+	spin_unlock(&info->lock);
+	mutex_unlock(&bufs_lock);
+	if (ret)
+		buf_free(new);
+	else
+		buf_put(old);
+out:
+	buf_put(old);
+	return ret;
+}
+
+static s64 batch_stats(struct mmap_info *info, void __user *addr, u64 len)
+{
+	struct stats_bin out;
+	size_t n = min_t(u64, len, sizeof(out));
+
+	stats_bin_fill(info->stats, &out);
+	return copy_to_user(addr, &out, n) ? -EFAULT : n;
+}
+
+static s64 batch_cmd(struct file *filp, struct mmap_info *info, const struct lkmc_cmd *cmd)
+{
+	void __user *addr = u64_to_user_ptr(cmd->addr);
+	struct lkmc_buf *buf;
+	s64 ret;
+
+	switch (cmd->op) {
+	case LKMC_OP_NOP:
+		return 0;
+	case LKMC_OP_FENCE:
+		smp_mb();
+		return 0;
+	case LKMC_OP_STATS:
+		return batch_stats(info, addr, cmd->len);
+	case LKMC_OP_RESIZE:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return buf_resize(filp, info, cmd->len);
+	case LKMC_OP_COPY_IN:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		break;
+	case LKMC_OP_COPY_OUT:
+	case LKMC_OP_FLUSH:
+		break;
+	default:
+		return -EINVAL;
+	}
+	buf = info_get_buf(info);
+	switch (cmd->op) {
+	case LKMC_OP_COPY_IN:
+		ret = buf_copy(buf, cmd->off, addr, cmd->len, true);
+		if (!ret) {
+			stat_add(info, LKMC_STAT_BYTES_WRITTEN, cmd->len);
+			ret = cmd->len;
+		}
+		break;
+	case LKMC_OP_COPY_OUT:
+		ret = buf_copy(buf, cmd->off, addr, cmd->len, false);
+		if (!ret) {
+			stat_add(info, LKMC_STAT_BYTES_READ, cmd->len);
+			ret = cmd->len;
+		}
+		break;
+	default:
+		ret = buf_flush(buf, cmd->off, cmd->len);
+		break;
+	}
+	buf_put(buf);
+	return ret;
+}
+
+/* Commands are copied in and their results out a chunk at a time, so a
+ * batch needs no allocation. */
+enum { BATCH_CHUNK = 8 };
+
+static long ioctl_batch(struct file *filp, struct mmap_info *info,
+		struct lkmc_batch __user *argp)
+{
+	struct lkmc_cmd cmds[BATCH_CHUNK];
+	struct lkmc_cmd __user *ucmds;
+	struct lkmc_batch arg;
+	u32 i, n, done = 0;
+	bool stop = false;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	if (!arg.version || arg.version > LKMC_ABI_VERSION ||
+	    arg.flags & ~LKMC_BATCH_STOP || arg.count > LKMC_BATCH_MAX)
+		return -EINVAL;
+	ucmds = u64_to_user_ptr(arg.cmds);
+	while (done < arg.count && !stop) {
+		n = min_t(u32, arg.count - done, BATCH_CHUNK);
+		if (copy_from_user(cmds, ucmds + done, n * sizeof(*cmds)))
+			return -EFAULT;
+		for (i = 0; i < n && !stop; i++) {
+			cmds[i].result = batch_cmd(filp, info, &cmds[i]);
+			stop = cmds[i].result < 0 && (arg.flags & LKMC_BATCH_STOP);
+		}
+		if (copy_to_user(ucmds + done, cmds, i * sizeof(*cmds)))
+			return -EFAULT;
+		done += i;
+		cond_resched();
+	}
+	return put_user(done, &argp->done);
+}
+
+static long ioctl_get_dirty(struct mmap_info *info, struct lkmc_dirty __user *argp)
+{
+	struct lkmc_dirty arg;
+	struct lkmc_buf *buf;
+	struct page *page;
+	unsigned long i, words;
+	u64 *out = NULL;
+	long ret = 0;
+
+	if (copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	buf = info_get_buf(info);
+	words = DIV_ROUND_UP(buf->nr_pages, 64);
+	if (arg.nr_pages < buf->nr_pages) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	out = kvzalloc(words * sizeof(*out), GFP_KERNEL);
+	if (!out) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	arg.nr_dirty = 0;
+	for_each_set_bit(i, buf->dirty, buf->nr_pages) {
+		/* Serializes with vm_page_mkwrite(): a write after
+		 * page_mkclean() faults and sets the bit again. */
+		page = buf_lock_page(buf, i);
+		if (test_and_clear_bit(i, buf->dirty)) {
+			lkmc_page_mkclean(page);
+			out[i / 64] |= 1ULL << (i % 64);
+			arg.nr_dirty++;
+		}
+		unlock_page(page);
+		cond_resched();
+	}
+	if (copy_to_user(u64_to_user_ptr(arg.bitmap), out, words * sizeof(*out))) {
+		/* Do not lose the writes, report them next time. */
+		for (i = 0; i < buf->nr_pages; i++)
+			if (out[i / 64] & (1ULL << (i % 64)))
+				set_bit(i, buf->dirty);
+		ret = -EFAULT;
+	}
+out:
+	arg.nr_pages = buf->nr_pages;
+	buf_put(buf);
+	kvfree(out);
+	if (ret && ret != -ENOSPC)
+		return ret;
+	if (copy_to_user(argp, &arg, sizeof(arg)))
+		return -EFAULT;
+	return ret;
+}
+
+static long ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct mmap_info *info = filp->private_data;
+	void __user *argp = (void __user *)arg;
+
+	/* Before anything else, it measures the bare entry and exit. */
+	if (cmd == LKMC_IOC_NOP)
+		return 0;
+	pr_debug("ioctl 0x%x\n", cmd);
+	switch (cmd) {
+	case LKMC_IOC_ATTACH:
+		return ioctl_attach(filp, info, argp);
+	case LKMC_IOC_MPMC_INIT:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return ioctl_mpmc_init(info, argp);
+	case LKMC_IOC_PIN:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return ioctl_pin(info, argp);
+	case LKMC_IOC_UNPIN:
+		return ioctl_unpin(info);
+	case LKMC_IOC_PIN_SUM:
+		return ioctl_pin_sum(info, argp);
+	case LKMC_IOC_EXPORT:
+		return ioctl_export(filp, info, argp);
+	case LKMC_IOC_SNAPSHOT:
+		return ioctl_snapshot(info, argp);
+	case LKMC_IOC_BUF_INFO:
+		return ioctl_buf_info(info, argp);
+	case LKMC_IOC_VERSION:
+		return put_user(LKMC_ABI_VERSION, (u32 __user *)argp);
+	case LKMC_IOC_BATCH:
+		return ioctl_batch(filp, info, argp);
+	case LKMC_IOC_GET_DIRTY:
+		return ioctl_get_dirty(info, argp);
+	case LKMC_IOC_CONSUMER_START:
+		/* The threads write the queue slots and the ping-pong line. */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		return ioctl_consumer_start(info, argp);
+	case LKMC_IOC_CONSUMER_STOP:
+		return ioctl_consumer_stop(info, argp);
+	case LKMC_IOC_DOORBELL:
+		return ioctl_doorbell(info, arg);
+	case LKMC_IOC_SET_CACHE:
+		if (arg >= LKMC_CACHE_NR)
+			return -EINVAL;
+		WRITE_ONCE(info->cache, arg);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+#define lkmc_compat_ioctl compat_ptr_ioctl
+#else
+/* compat_ptr_ioctl() of 5.5: the structs are the same, only pointers differ.
+ * Commands taking arg by value get it zero extended, as from 64 bits. */
+static long lkmc_compat_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	return ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+#endif
+
 static const struct file_operations fops = {
+	.owner = THIS_MODULE,
 	.mmap = mmap,
 	.open = open,
 	.release = release,
 	.read = read,
 	.write = write,
+	.splice_write = splice_write,
+	.unlocked_ioctl = ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = lkmc_compat_ioctl,
+#endif
 };
 
 static int myinit(void)
 {
+	info_cache = KMEM_CACHE(mmap_info, 0);
+	buf_cache = KMEM_CACHE(lkmc_buf, 0);
+	if (!info_cache || !buf_cache) {
+		kmem_cache_destroy(buf_cache);
+		kmem_cache_destroy(info_cache);
+		return -ENOMEM;
+	}
+	pool_init();
+	debugfs_dir = debugfs_create_dir(filename, NULL);
+	debugfs_opens = debugfs_create_dir("opens", debugfs_dir);
+	debugfs_create_file("stats", 0444, debugfs_dir,
+			(void __force *)&dev_stats, &stats_fops);
+	debugfs_create_file("stats.bin", 0444, debugfs_dir,
+			(void __force *)&dev_stats, &stats_bin_fops);
 	proc_create(filename, 0, NULL, &fops);
 	return 0;
 }
@@ -141,6 +2156,11 @@ static int myinit(void)
 static void myexit(void)
 {
 	remove_proc_entry(filename, NULL);
+	debugfs_remove_recursive(debugfs_dir);
+	pool_exit();
+	info_pool_exit();
+	kmem_cache_destroy(buf_cache);
+	kmem_cache_destroy(info_cache);
 }
 
 module_init(myinit)
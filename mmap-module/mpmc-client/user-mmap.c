@@ -0,0 +1,204 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE         /* sched_setaffinity */
+#include <assert.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uintmax_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_ATTACH */
+#include "../lkmc_mpmc.h" /* lkmc_mpmc_* */
+
+#define ITEMS		(1 << 24)
+#define MAX_PAIRS	64
+
+enum { SLOT_SIZE = 64, CAPACITY = 4096 };
+
+/* Message payload, fills a slot. */
+struct item {
+	uint64_t value;
+	char pad[SLOT_SIZE - sizeof(struct lkmc_mpmc_slot) - sizeof(uint64_t)];
+};
+
+#define POISON		UINT64_MAX
+
+/* Control block in plain shared anonymous memory, off the measured path. */
+struct control {
+	int go;
+	uint64_t consumed[MAX_PAIRS];
+	uint64_t sum[MAX_PAIRS];
+};
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		perror("sched_setaffinity");
+		assert(0);
+	}
+}
+
+static void *map_queue(const char *path, const char *name, size_t size)
+{
+	struct lkmc_attach attach;
+	struct lkmc_mpmc_init init;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&attach, 0, sizeof(attach));
+	snprintf(attach.name, sizeof(attach.name), "%s", name);
+	attach.size = size;
+	/* What the module would refuse with EINVAL. */
+	assert(!lkmc_mpmc_check(SLOT_SIZE, CAPACITY, size, sysconf(_SC_PAGESIZE)));
+	memset(&init, 0, sizeof(init));
+	init.slot_size = SLOT_SIZE;
+	init.capacity = CAPACITY;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &attach) || ioctl(fd, LKMC_IOC_MPMC_INIT, &init)) {
+		perror("ioctl");
+		assert(0);
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	close(fd);
+	return base;
+}
+
+static void wait_go(struct control *ctl)
+{
+	while (!__atomic_load_n(&ctl->go, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void producer(struct lkmc_mpmc *q, struct control *ctl, int id, uint64_t n)
+{
+	struct item it;
+	uint64_t i;
+
+	memset(&it, 0, sizeof(it));
+	wait_go(ctl);
+	for (i = 0; i < n; i++) {
+		it.value = (uint64_t)id * n + i;
+		while (lkmc_mpmc_enqueue(q, &it, sizeof(it)) == -EAGAIN)
+			;
+	}
+}
+
+static void consumer(struct lkmc_mpmc *q, struct control *ctl, int id)
+{
+	struct item it;
+	uint64_t count = 0, sum = 0;
+
+	wait_go(ctl);
+	for (;;) {
+		if (lkmc_mpmc_dequeue(q, &it, sizeof(it)) < 0)
+			continue;
+		if (it.value == POISON)
+			break;
+		sum += it.value;
+		count++;
+	}
+	ctl->consumed[id] = count;
+	ctl->sum[id] = sum;
+}
+
+/* Run pairs producers and pairs consumers, each on its own core.
+ * @return items per second */
+static double run(const char *path, int pairs)
+{
+	char name[LKMC_NAME_LEN];
+	struct timespec start, end;
+	struct lkmc_mpmc q;
+	struct control *ctl;
+	struct item it;
+	pid_t pids[2 * MAX_PAIRS];
+	uint64_t per_producer = ITEMS / pairs, total = 0, sum = 0, expected;
+	size_t size;
+	void *base;
+	int i, status;
+
+	snprintf(name, sizeof(name), "mpmc-%ju-%d", (uintmax_t)getpid(), pairs);
+	size = lkmc_mpmc_size(SLOT_SIZE, CAPACITY);
+	size = (size + sysconf(_SC_PAGE_SIZE) - 1) & ~(size_t)(sysconf(_SC_PAGE_SIZE) - 1);
+	base = map_queue(path, name, size);
+	assert(!lkmc_mpmc_open(&q, base, size));
+	ctl = mmap(NULL, sizeof(*ctl), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(ctl != MAP_FAILED);
+	memset(ctl, 0, sizeof(*ctl));
+
+	for (i = 0; i < 2 * pairs; i++) {
+		pids[i] = fork();
+		assert(pids[i] >= 0);
+		if (pids[i] == 0) {
+			pin(i);
+			if (i < pairs)
+				producer(&q, ctl, i, per_producer);
+			else
+				consumer(&q, ctl, i - pairs);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	__atomic_store_n(&ctl->go, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < pairs; i++)
+		assert(waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status));
+	memset(&it, 0, sizeof(it));
+	it.value = POISON;
+	for (i = 0; i < pairs; i++)
+		while (lkmc_mpmc_enqueue(&q, &it, sizeof(it)) == -EAGAIN)
+			;
+	for (i = pairs; i < 2 * pairs; i++)
+		assert(waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < pairs; i++) {
+		total += ctl->consumed[i];
+		sum += ctl->sum[i];
+	}
+	expected = per_producer * pairs;
+	assert(total == expected);
+	assert(sum == expected * (expected - 1) / 2);
+
+	munmap(ctl, sizeof(*ctl));
+	munmap(base, size);
+	return total / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	int pairs, max_pairs;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [max_pairs]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	max_pairs = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (max_pairs < 1)
+		max_pairs = 1;
+	if (max_pairs > MAX_PAIRS)
+		max_pairs = MAX_PAIRS;
+
+	printf("slot size = %d, capacity = %d, items = %d\n", SLOT_SIZE, CAPACITY, ITEMS);
+	printf("%-10s %-10s %s\n", "producers", "consumers", "Mitems/s");
+	for (pairs = 1; pairs <= max_pairs; pairs++)
+		printf("%-10d %-10d %.2f\n", pairs, pairs, run(argv[1], pairs) / 1e6);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE /* syscall, CPU_SET */
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uint32_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_NOP */
+#include "../rt.h" /* rt_setup */
+
+/* Fixed cost of the device path, to subtract from the per chunk costs of
+ * the other clients. The first rows only enter and leave the kernel, the
+ * last ones add a user access of the kind the Spectre and MDS mitigations
+ * make dearer (stac/clac, speculation barriers, buffer clearing on exit).
+ * The mitigations in effect are printed first. */
+
+#define VULNERABILITIES	"/sys/devices/system/cpu/vulnerabilities"
+
+enum { REPEATS = 5 };
+
+static int fd;
+static char buf[64];
+
+static void op_getppid(void)
+{
+	syscall(SYS_getppid);
+}
+
+static void op_nop(void)
+{
+	assert(!ioctl(fd, LKMC_IOC_NOP));
+}
+
+static void op_read0(void)
+{
+	assert(read(fd, buf, 0) == 0);
+}
+
+static void op_version(void)
+{
+	uint32_t version;
+
+	assert(!ioctl(fd, LKMC_IOC_VERSION, &version));
+}
+
+static void op_read64(void)
+{
+	assert(read(fd, buf, sizeof(buf)) == sizeof(buf));
+}
+
+static const struct null_op {
+	const char *name;
+	void (*run)(void);
+} ops[] = {
+	{ "getppid", op_getppid },
+	{ "ioctl NOP", op_nop },
+	{ "read 0 B", op_read0 },
+	{ "ioctl VERSION", op_version }, /* One put_user() of 4 bytes. */
+	{ "read 64 B", op_read64 }, /* One copy_to_user() of 64 bytes. */
+};
+
+#define OPS_NR	(sizeof(ops) / sizeof(ops[0]))
+
+static void print_mitigations(void)
+{
+	char path[512], line[256];
+	struct dirent *de;
+	FILE *f;
+	DIR *dir;
+
+	dir = opendir(VULNERABILITIES);
+	if (!dir) {
+		printf("mitigations: %s not available\n", VULNERABILITIES);
+		return;
+	}
+	printf("mitigations (%s):\n", VULNERABILITIES);
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", VULNERABILITIES, de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fgets(line, sizeof(line), f))
+			printf("  %-28s %s", de->d_name, line);
+		fclose(f);
+	}
+	closedir(dir);
+}
+
+/* @return the best of REPEATS runs of iters calls, in ns per call */
+static double measure(const struct null_op *op, unsigned long iters)
+{
+	struct timespec start, end;
+	double ns, min = 0;
+	unsigned long i;
+	int r;
+
+	for (r = 0; r < REPEATS; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < iters; i++)
+			op->run();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iters;
+		if (!r || ns < min)
+			min = ns;
+	}
+	return min;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iters;
+	double ns, base = 0;
+	size_t i;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [iters]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	iters = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000;
+	assert(iters);
+	if (rt_setup())
+		return EXIT_FAILURE;
+	fd = open(argv[1], O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	print_mitigations();
+	printf("%-16s %12s %14s\n", "op", "ns/op", "over getppid");
+	for (i = 0; i < OPS_NR; i++) {
+		ns = measure(&ops[i], iters);
+		if (!i)
+			base = ns;
+		printf("%-16s %12.1f %14.1f\n", ops[i].name, ns, ns - base);
+	}
+	close(fd);
+	return EXIT_SUCCESS;
+}
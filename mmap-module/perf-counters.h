@@ -0,0 +1,175 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+/* Hardware counters around a timed region of the benchmark clients.
+ *
+ * Every event is opened twice with perf_event_open(), once counting user mode
+ * and once kernel mode, so the per operation report tells a copy bound path
+ * (user instructions and LLC misses) from a TLB bound one (dTLB misses) or a
+ * syscall bound one (kernel cycles). Counting the kernel needs
+ * /proc/sys/kernel/perf_event_paranoid <= 1 or CAP_PERFMON. Events refused by
+ * the CPU, the hypervisor or that policy are reported as "-".
+ *
+ * Only the calling thread is counted:
+ *
+ *	struct perf_counters pc;
+ *
+ *	perf_counters_open(&pc);
+ *	perf_counters_start(&pc);
+ *	... ops operations ...
+ *	perf_counters_stop(&pc);
+ *	perf_counters_print(&pc, "label", ops);
+ *	perf_counters_close(&pc);
+ *
+ * The including file needs syscall(), e.g. from _DEFAULT_SOURCE.
+ */
+
+#include <linux/perf_event.h>
+#include <stdint.h> /* uint64_t */
+#include <stdio.h> /* printf */
+#include <string.h> /* memset */
+#include <sys/ioctl.h> /* ioctl */
+#include <sys/syscall.h> /* SYS_perf_event_open */
+#include <unistd.h> /* close, read, syscall */
+
+enum perf_counter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_LLC_MISSES,
+	PERF_DTLB_MISSES,
+	PERF_PAGE_FAULTS,
+	PERF_COUNTERS_NR,
+};
+
+enum perf_mode {
+	PERF_USER,
+	PERF_KERNEL,
+	PERF_MODES_NR,
+};
+
+#define PERF_CACHE_MISS(cache) \
+	((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+	 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct perf_counter_event {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} perf_counter_events[PERF_COUNTERS_NR] = {
+	[PERF_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_LLC_MISSES] = { "llc-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+	[PERF_DTLB_MISSES] = { "dtlb-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+	[PERF_PAGE_FAULTS] = { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+struct perf_counters {
+	int fd[PERF_COUNTERS_NR][PERF_MODES_NR]; /* -1 if not available. */
+	double count[PERF_COUNTERS_NR][PERF_MODES_NR]; /* Set by perf_counters_stop. */
+};
+
+static inline int perf_counter_open(const struct perf_counter_event *ev, enum perf_mode mode)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = ev->type;
+	attr.config = ev->config;
+	attr.disabled = 1;
+	attr.exclude_user = mode != PERF_USER;
+	attr.exclude_kernel = mode != PERF_KERNEL;
+	attr.exclude_hv = 1;
+	/* Scale the count if the PMU multiplexed it with other events. */
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* @return the number of counters opened, 0 if perf is not usable at all */
+static inline int perf_counters_open(struct perf_counters *pc)
+{
+	int i, m, n = 0;
+
+	for (i = 0; i < PERF_COUNTERS_NR; i++) {
+		for (m = 0; m < PERF_MODES_NR; m++) {
+			pc->fd[i][m] = perf_counter_open(&perf_counter_events[i], m);
+			pc->count[i][m] = -1;
+			if (pc->fd[i][m] >= 0)
+				n++;
+		}
+	}
+	return n;
+}
+
+static inline void perf_counters_start(struct perf_counters *pc)
+{
+	int i, m;
+
+	for (i = 0; i < PERF_COUNTERS_NR; i++) {
+		for (m = 0; m < PERF_MODES_NR; m++) {
+			if (pc->fd[i][m] < 0)
+				continue;
+			ioctl(pc->fd[i][m], PERF_EVENT_IOC_RESET, 0);
+			ioctl(pc->fd[i][m], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+static inline void perf_counters_stop(struct perf_counters *pc)
+{
+	uint64_t v[3]; /* value, time enabled, time running */
+	int i, m;
+
+	for (i = 0; i < PERF_COUNTERS_NR; i++)
+		for (m = 0; m < PERF_MODES_NR; m++)
+			if (pc->fd[i][m] >= 0)
+				ioctl(pc->fd[i][m], PERF_EVENT_IOC_DISABLE, 0);
+	for (i = 0; i < PERF_COUNTERS_NR; i++) {
+		for (m = 0; m < PERF_MODES_NR; m++) {
+			pc->count[i][m] = -1;
+			if (pc->fd[i][m] < 0 ||
+			    read(pc->fd[i][m], v, sizeof(v)) != sizeof(v))
+				continue;
+			if (!v[2])
+				pc->count[i][m] = v[0] ? -1 : 0;
+			else
+				pc->count[i][m] = (double)v[0] * v[1] / v[2];
+		}
+	}
+}
+
+/* Print the counts of the last start/stop divided by ops, one event a line. */
+static inline void perf_counters_print(const struct perf_counters *pc, const char *label, uint64_t ops)
+{
+	int i, m;
+
+	if (!ops)
+		ops = 1;
+	printf("perf %s, per op over %ju ops:\n", label, (uintmax_t)ops);
+	printf("  %-14s %14s %14s\n", "event", "user", "kernel");
+	for (i = 0; i < PERF_COUNTERS_NR; i++) {
+		printf("  %-14s", perf_counter_events[i].name);
+		for (m = 0; m < PERF_MODES_NR; m++) {
+			if (pc->count[i][m] < 0)
+				printf(" %14s", "-");
+			else
+				printf(" %14.2f", pc->count[i][m] / ops);
+		}
+		putchar('\n');
+	}
+}
+
+static inline void perf_counters_close(struct perf_counters *pc)
+{
+	int i, m;
+
+	for (i = 0; i < PERF_COUNTERS_NR; i++) {
+		for (m = 0; m < PERF_MODES_NR; m++) {
+			if (pc->fd[i][m] >= 0)
+				close(pc->fd[i][m]);
+			pc->fd[i][m] = -1;
+		}
+	}
+}
+
+#endif
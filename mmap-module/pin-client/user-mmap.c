@@ -0,0 +1,82 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uintmax_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_PIN */
+
+enum { BUFFER_SIZE = 32 << 20 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	struct lkmc_pin pin;
+	uint64_t sum, kernel_sum;
+	double t0, t1, t2, t3;
+	unsigned char *buf;
+	size_t i, len;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [bytes]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	len = argc > 2 ? strtoull(argv[2], NULL, 0) : BUFFER_SIZE;
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+
+	/* An ordinary heap buffer, deliberately not page aligned. */
+	buf = malloc(len + 1);
+	assert(buf);
+	buf++;
+	sum = 0;
+	for (i = 0; i < len; i++) {
+		buf[i] = i * 7;
+		sum += buf[i];
+	}
+
+	pin.addr = (uintptr_t)buf;
+	pin.len = len;
+	t0 = now();
+	if (ioctl(fd, LKMC_IOC_PIN, &pin)) {
+		perror("ioctl LKMC_IOC_PIN");
+		assert(0);
+	}
+	t1 = now();
+	if (ioctl(fd, LKMC_IOC_PIN_SUM, &kernel_sum)) {
+		perror("ioctl LKMC_IOC_PIN_SUM");
+		assert(0);
+	}
+	t2 = now();
+	assert(kernel_sum == sum);
+	if (ioctl(fd, LKMC_IOC_UNPIN)) {
+		perror("ioctl LKMC_IOC_UNPIN");
+		assert(0);
+	}
+	t3 = now();
+
+	printf("bytes = %zu\n", len);
+	printf("pin = %.3f ms (%.0f MB/s)\n", (t1 - t0) * 1e3, len / (t1 - t0) / 1e6);
+	printf("kernel read in place = %.3f ms (%.0f MB/s)\n", (t2 - t1) * 1e3, len / (t2 - t1) / 1e6);
+	printf("unpin = %.3f ms\n", (t3 - t2) * 1e3);
+
+	free(buf - 1);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* syscall */
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -10,6 +11,7 @@
 #include <unistd.h> /* sysconf */
 
 #include "../common.h" /* virt_to_phys_user */
+#include "../perf-counters.h"
 
 #define TRIALS		1000000000
 
@@ -22,6 +24,8 @@ int main(int argc, char **argv)
 	char *address1, *address2;
 	char buf[BUFFER_SIZE];
 	uintptr_t paddr;
+	struct perf_counters pc;
+	uint64_t writes = 0;
 
 	if (argc < 2) {
 		printf("Usage: %s <mmap_file>\n", argv[0]);
@@ -52,14 +56,20 @@ int main(int argc, char **argv)
 	printf("paddr1 = 0x%jx\n", (uintmax_t)paddr);
 
 	int cnt = 0;
+	perf_counters_open(&pc);
 	// clock_t start_t, end_t, total_t;
 	// start_t = clock();
 	// printf("Starting of the program, start_t = %ld\n", start_t);
 
+	perf_counters_start(&pc);
 	while(0 != read(data_to_write_fd, buf, BUFFER_SIZE)){
 		cnt+=write(fd, buf, BUFFER_SIZE);
+		writes++;
         // printf("cnt: %d\n", (int)cnt);
 	}
+	perf_counters_stop(&pc);
+	perf_counters_print(&pc, "read+write", writes);
+	perf_counters_close(&pc);
 
 	// end_t = clock();
 	// printf("End of the big loop, end_t = %ld\n", end_t);
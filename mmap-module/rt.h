@@ -0,0 +1,116 @@
+#ifndef RT_H
+#define RT_H
+
+/* Low jitter mode of the benchmark clients, set from the environment:
+ *
+ *	RT_PRIO=n	run under SCHED_FIFO at priority n, 1 to 99
+ *	RT_CPU=c	run on CPU c only, or on the first isolated or nohz_full
+ *			CPU for RT_CPU=isolated
+ *
+ * With either set all memory is also locked, so that no page fault lands in
+ * a timed region. Needs CAP_SYS_NICE and CAP_IPC_LOCK, or the matching
+ * RLIMIT_RTPRIO and RLIMIT_MEMLOCK. The including file needs the CPU_*
+ * macros of sched.h, i.e. _GNU_SOURCE.
+ */
+
+#include <errno.h>
+#include <sched.h> /* sched_setaffinity, sched_setscheduler */
+#include <stdio.h> /* fopen, fprintf */
+#include <stdlib.h> /* getenv, strtol */
+#include <string.h> /* strcmp */
+#include <sys/mman.h> /* mlockall */
+
+/* @return the first CPU of the list in file, e.g. "2-3,6", -1 if empty */
+static inline int rt_first_cpu(const char *file)
+{
+	FILE *f;
+	int cpu = -1;
+
+	f = fopen(file, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &cpu) != 1)
+		cpu = -1;
+	fclose(f);
+	return cpu;
+}
+
+/* @return the first CPU booted with isolcpus= or nohz_full=, -1 if none */
+static inline int rt_isolated_cpu(void)
+{
+	int isolated = rt_first_cpu("/sys/devices/system/cpu/isolated");
+	int nohz_full = rt_first_cpu("/sys/devices/system/cpu/nohz_full");
+
+	if (isolated < 0 || (nohz_full >= 0 && nohz_full < isolated))
+		return nohz_full;
+	return isolated;
+}
+
+/* Parse the value of the environment variable name, a number from min to max.
+ * @return 0, -1 with a message on anything else */
+static inline int rt_parse(const char *name, const char *value, long min, long max,
+		long *out)
+{
+	char *end;
+
+	errno = 0;
+	*out = strtol(value, &end, 0);
+	if (errno || end == value || *end || *out < min || *out > max) {
+		fprintf(stderr, "rt: bad %s=%s\n", name, value);
+		return -1;
+	}
+	return 0;
+}
+
+/* Apply RT_CPU and RT_PRIO to the calling process.
+ * @return 0, also when neither is set, -1 on failure */
+static inline int rt_setup(void)
+{
+	const char *cpu_env = getenv("RT_CPU");
+	const char *prio_env = getenv("RT_PRIO");
+	struct sched_param sp;
+	cpu_set_t set;
+	int cpu = -1;
+	long val;
+
+	if (!cpu_env && !prio_env)
+		return 0;
+	if (cpu_env) {
+		if (!strcmp(cpu_env, "isolated")) {
+			cpu = rt_isolated_cpu();
+			if (cpu < 0) {
+				fprintf(stderr, "rt: no isolated CPU\n");
+				return -1;
+			}
+		} else {
+			if (rt_parse("RT_CPU", cpu_env, 0, CPU_SETSIZE - 1, &val))
+				return -1;
+			cpu = val;
+		}
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			perror("rt: sched_setaffinity");
+			return -1;
+		}
+	}
+	if (prio_env) {
+		if (rt_parse("RT_PRIO", prio_env, sched_get_priority_min(SCHED_FIFO),
+				sched_get_priority_max(SCHED_FIFO), &val))
+			return -1;
+		sp.sched_priority = val;
+		if (sched_setscheduler(0, SCHED_FIFO, &sp)) {
+			perror("rt: sched_setscheduler");
+			return -1;
+		}
+	}
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("rt: mlockall");
+		return -1;
+	}
+	fprintf(stderr, "rt: cpu %d, SCHED_FIFO priority %s, memory locked\n",
+		cpu, prio_env ? prio_env : "none");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uintmax_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../common.h" /* virt_to_phys_user */
+#include "../lkmc_mmap.h" /* LKMC_IOC_ATTACH */
+
+#define TRIALS		1000000
+
+enum { BUFFER_SIZE = 1000 };
+
+/* One slot mailbox at the start of the shared buffer. */
+struct mailbox {
+	uint64_t full;
+	uint64_t seq;
+	char data[BUFFER_SIZE];
+};
+
+/* Open the device in its own file and attach it to the named buffer,
+ * as two unrelated processes would. */
+static struct mailbox *attach(const char *path, const char *name, long page_size, uintptr_t *paddr)
+{
+	struct lkmc_attach arg;
+	struct mailbox *box;
+	int fd;
+
+	fd = open(path, O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&arg, 0, sizeof(arg));
+	strncpy(arg.name, name, sizeof(arg.name) - 1);
+	arg.size = page_size;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &arg)) {
+		perror("ioctl");
+		assert(0);
+	}
+	box = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (box == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	/* The mapping keeps the buffer alive. */
+	close(fd);
+	assert(!virt_to_phys_user(paddr, getpid(), (uintptr_t)box));
+	return box;
+}
+
+static void consumer(struct mailbox *box)
+{
+	uint64_t i;
+
+	for (i = 0; i < TRIALS; i++) {
+		while (!__atomic_load_n(&box->full, __ATOMIC_ACQUIRE))
+			;
+		assert(box->seq == i);
+		assert(box->data[0] == (char)i);
+		__atomic_store_n(&box->full, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void producer(struct mailbox *box)
+{
+	char buf[BUFFER_SIZE];
+	uint64_t i;
+
+	for (i = 0; i < TRIALS; i++) {
+		memset(buf, (char)i, sizeof(buf));
+		while (__atomic_load_n(&box->full, __ATOMIC_ACQUIRE))
+			;
+		box->seq = i;
+		memcpy(box->data, buf, sizeof(buf));
+		__atomic_store_n(&box->full, 1, __ATOMIC_RELEASE);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	long page_size;
+	const char *name;
+	struct mailbox *box;
+	struct timespec start, end;
+	uintptr_t paddr;
+	pid_t pid;
+	int status;
+	double secs;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [buffer_name]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	name = argc > 2 ? argv[2] : "shared-client";
+	page_size = sysconf(_SC_PAGE_SIZE);
+	assert(sizeof(struct mailbox) <= (size_t)page_size);
+
+	/* Attach before forking so the consumer cannot see an older buffer of that name. */
+	box = attach(argv[1], name, page_size, &paddr);
+	printf("producer paddr = 0x%jx\n", (uintmax_t)paddr);
+	box->full = 0;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		assert(0);
+	}
+	if (pid == 0) {
+		/* Drop the inherited mapping and go through a separate open. */
+		munmap(box, page_size);
+		box = attach(argv[1], name, page_size, &paddr);
+		printf("consumer paddr = 0x%jx\n", (uintmax_t)paddr);
+		consumer(box);
+		return EXIT_SUCCESS;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	producer(box);
+	assert(waitpid(pid, &status, 0) == pid);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("messages = %d, message size = %d\n", TRIALS, BUFFER_SIZE);
+	printf("%.0f messages/s, %.1f MB/s\n", TRIALS / secs, TRIALS * (double)BUFFER_SIZE / secs / 1e6);
+
+	puts("munmap");
+	if (munmap(box, page_size)) {
+		perror("munmap");
+		assert(0);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uint64_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_SNAPSHOT */
+
+enum { BUFFER_SIZE = 64 << 20, SNAPSHOTS = 16 };
+
+struct producer {
+	pthread_t thread;
+	char *address;
+	size_t nr_pages;
+	long page_size;
+	volatile int stop;
+	uint64_t sweeps;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write generation g at the start of every page, from the first page to the
+ * last, then g + 1 and so on. */
+static void *produce(void *arg)
+{
+	struct producer *p = arg;
+	uint64_t g;
+	size_t i;
+
+	for (g = 1; !p->stop; g++) {
+		for (i = 0; i < p->nr_pages; i++)
+			__atomic_store_n((uint64_t *)(p->address + i * p->page_size), g,
+					__ATOMIC_RELEASE);
+		p->sweeps = g;
+	}
+	return NULL;
+}
+
+/* A consistent cut of the sweeps: the generations never increase along the
+ * buffer, and the first page is at most one sweep ahead of the last. */
+static int consistent(const char *snap, size_t nr_pages, long page_size)
+{
+	uint64_t first, prev, g;
+	size_t i;
+
+	first = prev = *(const uint64_t *)snap;
+	for (i = 1; i < nr_pages; i++) {
+		g = *(const uint64_t *)(snap + i * page_size);
+		if (g > prev)
+			return 0;
+		prev = g;
+	}
+	return first - prev <= 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct lkmc_snapshot snapshot;
+	struct lkmc_attach attach;
+	struct producer producer;
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct timespec pause = { 0, 100000000 };
+	double t0, taken;
+	unsigned i, snapshots;
+	int checked;
+	char *snap;
+	size_t size;
+	int fd;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file> [bytes] [snapshots]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	size = argc > 2 ? strtoull(argv[2], NULL, 0) : BUFFER_SIZE;
+	size = (size + page_size - 1) / page_size * page_size;
+	snapshots = argc > 3 ? strtoul(argv[3], NULL, 0) : SNAPSHOTS;
+
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&attach, 0, sizeof(attach));
+	strncpy(attach.name, "snapshot-client", sizeof(attach.name) - 1);
+	attach.size = size;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &attach)) {
+		perror("ioctl LKMC_IOC_ATTACH");
+		assert(0);
+	}
+	memset(&producer, 0, sizeof(producer));
+	producer.address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (producer.address == MAP_FAILED) {
+		perror("mmap");
+		assert(0);
+	}
+	producer.nr_pages = size / page_size;
+	producer.page_size = page_size;
+	assert(!pthread_create(&producer.thread, NULL, produce, &producer));
+
+	printf("pages = %zu\n", producer.nr_pages);
+	printf("snapshot snapshot_us first_gen last_gen consistent\n");
+	for (i = 0; i < snapshots; i++) {
+		nanosleep(&pause, NULL);
+		t0 = now();
+		if (ioctl(fd, LKMC_IOC_SNAPSHOT, &snapshot)) {
+			perror("ioctl LKMC_IOC_SNAPSHOT");
+			assert(0);
+		}
+		taken = now() - t0;
+		snap = mmap(NULL, size, PROT_READ, MAP_SHARED, snapshot.fd, 0);
+		if (snap == MAP_FAILED) {
+			perror("mmap snapshot");
+			assert(0);
+		}
+		checked = consistent(snap, producer.nr_pages, page_size);
+		printf("%u %.1f %llu %llu %s\n", i, taken * 1e6,
+				(unsigned long long)*(uint64_t *)snap,
+				(unsigned long long)*(uint64_t *)(snap + size - page_size),
+				checked ? "yes" : "no");
+		assert(checked);
+		munmap(snap, size);
+		close(snapshot.fd);
+	}
+
+	producer.stop = 1;
+	assert(!pthread_join(producer.thread, NULL));
+	printf("producer_sweeps = %llu\n", (unsigned long long)producer.sweeps);
+	munmap(producer.address, size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -11,6 +11,7 @@
 #include <unistd.h> /* sysconf */
 
 #include "../common.h" /* virt_to_phys_user */
+#include "../perf-counters.h"
 
 #define TRIALS		1000000000
 
@@ -23,7 +24,8 @@ int main(int argc, char **argv)
 	char *address1, *address2;
 	char buf[BUFFER_SIZE];
 	uintptr_t paddr;
-
+	struct perf_counters pc;
+	uint64_t splices = 0;
 
 	if (argc < 2) {
 		printf("Usage: %s <mmap_file>\n", argv[0]);
@@ -54,11 +56,14 @@ int main(int argc, char **argv)
 	printf("paddr1 = 0x%jx\n", (uintmax_t)paddr);
 
 	size_t cnt = 0;
+	perf_counters_open(&pc);
 	// clock_t start_t, end_t, total_t;
     int pbuf[2];
-    if (pipe(pbuf) < 0) 
-        exit(1); 
+    if (pipe(pbuf) < 0) {
+        exit(1);
+    }
 	// start_t = clock();
+	perf_counters_start(&pc);
 	while(1) {
         // printf("1\n");
         // size_t bt = splice(data_to_write_fd, NULL, buf, NULL, BUFFER_SIZE, SPLICE_F_MOVE);
@@ -68,8 +73,12 @@ int main(int argc, char **argv)
             break;
         }
 		cnt += splice(pbuf[0], NULL, fd, NULL, BUFFER_SIZE, SPLICE_F_MOVE);
+		splices++;
         // printf("cnt: %d\n", (int)cnt);
     }
+	perf_counters_stop(&pc);
+	perf_counters_print(&pc, "splice in+out", splices);
+	perf_counters_close(&pc);
 	// end_t = clock();	
 	// total_t = ((double)(end_t - start_t)) / CLOCKS_PER_SEC;
     // printf("Starting of the program, start_t = %ld\n", start_t);
@@ -1,4 +1,5 @@
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* syscall */
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -6,31 +7,71 @@
 #include <stdint.h> /* uintmax_t */
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h> /* sysconf */
 
 #include "../common.h" /* virt_to_phys_user */
+#include "../copy-kernels.h" /* copy_kernel_find */
+#include "../perf-counters.h"
 
-#define TRIALS		1000000000
+/* Each kernel copies the whole file into the mapping this many times. */
+#define PASSES		1000
 
 enum { BUFFER_SIZE = 1000 };
 
+/* Copy data into the mapped page in chunk byte pieces, like the old
+ * read/strcpy loop but with the exact length instead of relying on a NUL.
+ * The counters of pc cover the same region, one copy call being an op.
+ * @return bytes per second */
+static double measure(const struct copy_kernel *k, char *dst, const char *data, size_t len, size_t chunk,
+		struct perf_counters *pc)
+{
+	struct timespec start, end;
+	size_t off, n;
+	int pass;
+
+	perf_counters_start(pc);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pass = 0; pass < PASSES; pass++) {
+		for (off = 0; off < len; off += n) {
+			n = len - off < chunk ? len - off : chunk;
+			k->copy(dst, data + off, n);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	perf_counters_stop(pc);
+	return PASSES * (double)len /
+		((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
 int main(int argc, char **argv)
 {
 	int fd;
 	long page_size;
-	char *address1, *address2;
-	char buf[BUFFER_SIZE];
+	char *address1, *data;
+	const char *kernel, *data_file;
+	const struct copy_kernel *k;
 	uintptr_t paddr;
+	struct stat st;
+	struct perf_counters pc[2];
+	double rate[2];
+	char label[64];
+	size_t i, n, len, chunk[2];
+	ssize_t nread;
 
 	if (argc < 2) {
-		printf("Usage: %s <mmap_file>\n", argv[0]);
+		printf("Usage: %s <mmap_file> [memcpy|rep-movsb|avx2-nt|avx512-nt|best|all] [data_file]\n", argv[0]);
 		return EXIT_FAILURE;
 	}
+	kernel = argc > 2 ? argv[2] : "all";
+	if (!strcmp(kernel, "best"))
+		kernel = copy_kernel_best()->name;
+	data_file = argc > 3 ? argv[3] : "../../../random-files/2k-files/file.txt";
 	page_size = sysconf(_SC_PAGE_SIZE);
 	printf("open pathname = %s\n", argv[1]);
 	fd = open(argv[1], O_RDWR | O_SYNC);
-	int data_to_write_fd = open("../../../random-files/2k-files/file.txt", O_RDONLY);
+	int data_to_write_fd = open(data_file, O_RDONLY);
 	if (fd < 0 || data_to_write_fd < 0) {
 		perror("open");
 		assert(0);
@@ -51,18 +92,44 @@ int main(int argc, char **argv)
 	assert(!virt_to_phys_user(&paddr, getpid(), (uintptr_t)address1));
 	printf("paddr1 = 0x%jx\n", (uintmax_t)paddr);
 
-	int cnt = 0;
-	// clock_t start_t, end_t, total_t;
-	// start_t = clock();
-	// printf("Starting of the program, start_t = %ld\n", start_t);
-	while(0 != read(data_to_write_fd, buf, BUFFER_SIZE)){
-		strcpy(address1, buf);
+	/* Load the data up front so only the copy into the mapping is timed. */
+	assert(!fstat(data_to_write_fd, &st));
+	len = st.st_size;
+	data = aligned_alloc(64, len + 64);
+	assert(data);
+	for (i = 0; i < len; i += nread) {
+		nread = read(data_to_write_fd, data + i, len - i);
+		if (nread <= 0) {
+			perror("read");
+			assert(0);
+		}
+	}
+	printf("data size = %zu\n", len);
+	chunk[0] = BUFFER_SIZE;
+	chunk[1] = page_size;
+	perf_counters_open(&pc[0]);
+	perf_counters_open(&pc[1]);
+
+	printf("%-12s %16s %16s\n", "kernel", "1000 B MB/s", "page MB/s");
+	for (i = 0; i < COPY_KERNELS_NR; i++) {
+		if (strcmp(kernel, "all") && strcmp(kernel, copy_kernels[i].name))
+			continue;
+		k = copy_kernel_find(copy_kernels[i].name);
+		if (!k) {
+			printf("%-12s %16s %16s\n", copy_kernels[i].name, "unsupported", "unsupported");
+			continue;
+		}
+		rate[0] = measure(k, address1, data, len, chunk[0], &pc[0]);
+		rate[1] = measure(k, address1, data, len, chunk[1], &pc[1]);
+		printf("%-12s %16.0f %16.0f\n", k->name, rate[0] / 1e6, rate[1] / 1e6);
+		for (n = 0; n < 2; n++) {
+			snprintf(label, sizeof(label), "%s %zu B", k->name, chunk[n]);
+			perf_counters_print(&pc[n], label, PASSES * ((len + chunk[n] - 1) / chunk[n]));
+		}
 	}
-	// end_t = clock();
-	// printf("End of the big loop, end_t = %ld\n", end_t);
-	
-	// total_t = ((double)(end_t - start_t)) / CLOCKS_PER_SEC;
-	// printf("Time: %f\n", (double)total_t);
+	perf_counters_close(&pc[0]);
+	perf_counters_close(&pc[1]);
+	free(data);
 
     /* Cleanup. */
     puts("munmap 1");
@@ -73,4 +140,4 @@ int main(int argc, char **argv)
     puts("close");
 	close(fd);
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -1,4 +1,5 @@
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE /* syscall */
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -9,6 +10,7 @@
 #include <unistd.h> /* sysconf */
 
 #include "common.h" /* virt_to_phys_user */
+#include "perf-counters.h"
 
 enum { BUFFER_SIZE = 4 };
 
@@ -19,6 +21,7 @@ int main(int argc, char **argv)
 	char *address1, *address2;
 	char buf[BUFFER_SIZE];
 	uintptr_t paddr;
+	struct perf_counters pc;
 
 	if (argc < 2) {
 		printf("Usage: %s <mmap_file>\n", argv[0]);
@@ -67,12 +70,19 @@ int main(int argc, char **argv)
 	assert(!virt_to_phys_user(&paddr, getpid(), (uintptr_t)address2));
 	printf("paddr2 = 0x%jx\n", (uintmax_t)paddr);
 
+	/* Count the two kernel copies below, one read and one write. */
+	perf_counters_open(&pc);
+	perf_counters_start(&pc);
+
     /* Check that modifications made from userland are also visible from the kernel. */
 	read(fd, buf, BUFFER_SIZE);
-	assert(!memcmp(buf, "qwer", BUFFER_SIZE));
 
 	/* Modify the data from the kernel, and check that the change is visible from userland. */
 	write(fd, "zxcv", 4);
+	perf_counters_stop(&pc);
+	perf_counters_print(&pc, "read+write", 2);
+	perf_counters_close(&pc);
+	assert(!memcmp(buf, "qwer", BUFFER_SIZE));
 	assert(!strcmp(address1, "zxcv"));
 	assert(!strcmp(address2, "zxcv"));
 
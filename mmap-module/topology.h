@@ -0,0 +1,111 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/* CPU pairs for producer/consumer placement, from /sys/devices/system/cpu.
+ *
+ * Only the CPUs the calling process may run on are considered. Two CPUs
+ * with the same package and core id are SMT siblings. The including file
+ * needs the CPU_* macros of sched.h, i.e. _GNU_SOURCE.
+ */
+
+#include <sched.h> /* sched_getaffinity, CPU_ISSET */
+#include <stdio.h> /* fopen, fscanf */
+
+#define TOPOLOGY_MAX_CPUS	1024
+
+enum placement {
+	PLACE_SAME_CPU,		/* Both on one logical CPU. */
+	PLACE_SMT,		/* Two hardware threads of one core. */
+	PLACE_SAME_SOCKET,	/* Two cores of one package. */
+	PLACE_CROSS_SOCKET,	/* Two packages. */
+	PLACE_NR,
+};
+
+static const char *const placement_names[PLACE_NR] = {
+	[PLACE_SAME_CPU] = "same-cpu",
+	[PLACE_SMT] = "smt-sibling",
+	[PLACE_SAME_SOCKET] = "same-socket",
+	[PLACE_CROSS_SOCKET] = "cross-socket",
+};
+
+struct cpu_topology {
+	int cpu;
+	int package;
+	int core;
+};
+
+/* @return the integer in /sys/devices/system/cpu/cpu<cpu>/topology/<file>,
+ * -1 if missing */
+static inline int topology_read_id(int cpu, const char *file)
+{
+	char path[128];
+	FILE *f;
+	int id = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &id) != 1)
+		id = -1;
+	fclose(f);
+	return id;
+}
+
+/* Fill cpus with the allowed CPUs in increasing order.
+ * @return their number, -1 on failure */
+static inline int topology_read(struct cpu_topology *cpus, int max)
+{
+	cpu_set_t set;
+	int cpu, n = 0;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+	for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		cpus[n].cpu = cpu;
+		/* Without topology files every CPU is its own core of package 0. */
+		cpus[n].package = topology_read_id(cpu, "physical_package_id");
+		cpus[n].core = topology_read_id(cpu, "core_id");
+		if (cpus[n].package < 0)
+			cpus[n].package = 0;
+		if (cpus[n].core < 0)
+			cpus[n].core = cpu;
+		n++;
+	}
+	return n;
+}
+
+static inline enum placement topology_placement(const struct cpu_topology *a,
+		const struct cpu_topology *b)
+{
+	if (a->cpu == b->cpu)
+		return PLACE_SAME_CPU;
+	if (a->package != b->package)
+		return PLACE_CROSS_SOCKET;
+	if (a->core == b->core)
+		return PLACE_SMT;
+	return PLACE_SAME_SOCKET;
+}
+
+/* Find the pair of CPUs in that placement with the lowest first CPU.
+ * @return 0 with the CPUs in *first and *second, -1 if the machine has none */
+static inline int topology_pair(const struct cpu_topology *cpus, int n, enum placement place,
+		int *first, int *second)
+{
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			if (topology_placement(&cpus[i], &cpus[j]) == place) {
+				*first = cpus[i].cpu;
+				*second = cpus[j].cpu;
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+#endif
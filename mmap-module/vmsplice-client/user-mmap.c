@@ -11,6 +11,7 @@
 #include <unistd.h> /* sysconf */
 
 #include "../common.h" /* virt_to_phys_user */
+#include "../perf-counters.h"
 
 #define TRIALS		1000000000
 
@@ -23,7 +24,8 @@ int main(int argc, char **argv)
 	char *address1, *address2;
 	char buf[BUFFER_SIZE];
 	uintptr_t paddr;
-
+	struct perf_counters pc;
+	uint64_t vmsplices = 0;
 
 	if (argc < 2) {
 		printf("Usage: %s <mmap_file>\n", argv[0]);
@@ -62,12 +64,18 @@ int main(int argc, char **argv)
     struct iovec local; 
     local.iov_base = address1;
     local.iov_len = page_size;
+	perf_counters_open(&pc);
+	perf_counters_start(&pc);
 	while(1) {
         ssize_t nread = vmsplice(data_to_write_fd, &local, page_size, SPLICE_F_MORE);
-        if( 0 == nread ){
+        if( nread <= 0 ){
             break;
         }
+        vmsplices++;
     }
+	perf_counters_stop(&pc);
+	perf_counters_print(&pc, "vmsplice", vmsplices);
+	perf_counters_close(&pc);
 
     /* Cleanup. */
     puts("munmap 1");
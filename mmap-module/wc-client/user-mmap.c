@@ -0,0 +1,127 @@
+#define _XOPEN_SOURCE 700
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h> /* uintmax_t */
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h> /* sysconf */
+#if defined(__x86_64__)
+#include <emmintrin.h> /* _mm_stream_si128, _mm_sfence */
+#endif
+
+#include "../lkmc_mmap.h" /* LKMC_IOC_ATTACH, LKMC_IOC_SET_CACHE */
+
+/* Each measurement repeats passes over the buffer for at least this long. */
+#define MIN_SECONDS	0.5
+
+enum { BUFFER_SIZE = 4 << 20 };
+
+static const char *cache_names[LKMC_CACHE_NR] = {
+	[LKMC_CACHE_WB] = "write-back",
+	[LKMC_CACHE_WC] = "write-combining",
+	[LKMC_CACHE_UC] = "uncached",
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Regular 64-bit stores, as a producer filling the buffer would do. */
+static void store_regular(char *dst, size_t len, uint64_t v)
+{
+	volatile uint64_t *p = (volatile uint64_t *)dst;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(*p); i++)
+		p[i] = v;
+}
+
+/* Non-temporal 16-byte stores that bypass the cache. */
+static void store_streaming(char *dst, size_t len, uint64_t v)
+{
+#if defined(__x86_64__)
+	__m128i x = _mm_set1_epi64x(v);
+	size_t i;
+
+	for (i = 0; i < len; i += 16)
+		_mm_stream_si128((__m128i *)(dst + i), x);
+	_mm_sfence();
+#else
+	store_regular(dst, len, v);
+#endif
+}
+
+/* @return bytes per second */
+static double measure(void (*store)(char *, size_t, uint64_t), char *dst, size_t len)
+{
+	double start, elapsed;
+	uint64_t passes = 0;
+
+	start = now();
+	do {
+		store(dst, len, passes);
+		passes++;
+		elapsed = now() - start;
+	} while (elapsed < MIN_SECONDS);
+	return passes * (double)len / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	struct lkmc_attach attach;
+	double regular, streaming[LKMC_CACHE_NR];
+	char *address;
+	int fd, mode;
+
+	if (argc < 2) {
+		printf("Usage: %s <mmap_file>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	fd = open(argv[1], O_RDWR | O_SYNC);
+	if (fd < 0) {
+		perror("open");
+		assert(0);
+	}
+	memset(&attach, 0, sizeof(attach));
+	snprintf(attach.name, sizeof(attach.name), "wc-client-%ju", (uintmax_t)getpid());
+	attach.size = BUFFER_SIZE;
+	if (ioctl(fd, LKMC_IOC_ATTACH, &attach)) {
+		perror("ioctl");
+		assert(0);
+	}
+
+	printf("buffer size = %d bytes\n", BUFFER_SIZE);
+	printf("%-16s %14s %14s\n", "mapping", "regular MB/s", "streaming MB/s");
+	for (mode = 0; mode < LKMC_CACHE_NR; mode++) {
+		if (ioctl(fd, LKMC_IOC_SET_CACHE, mode)) {
+			perror("ioctl");
+			assert(0);
+		}
+		address = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (address == MAP_FAILED) {
+			perror("mmap");
+			assert(0);
+		}
+		/* Take the faults outside the measurement. */
+		store_regular(address, BUFFER_SIZE, 0);
+		regular = measure(store_regular, address, BUFFER_SIZE);
+		streaming[mode] = measure(store_streaming, address, BUFFER_SIZE);
+		printf("%-16s %14.0f %14.0f\n", cache_names[mode], regular / 1e6, streaming[mode] / 1e6);
+		if (munmap(address, BUFFER_SIZE)) {
+			perror("munmap");
+			assert(0);
+		}
+	}
+	printf("write-combining streaming gain over write-back: %.2fx\n",
+			streaming[LKMC_CACHE_WC] / streaming[LKMC_CACHE_WB]);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE /* sched_setaffinity, CPU_SET */
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../mmap-module/topology.h" /* topology_read, topology_pair */
+
+/* Run a benchmark command once per placement of its user process and its
+ * kernel worker: same CPU, SMT siblings, two cores of a socket, two sockets.
+ *
+ * The user process is pinned with sched_setaffinity() before exec. The kernel
+ * worker is placed through the command line, where %k stands for its CPU (and
+ * %u for the user one), or through a module parameter written before the run.
+ **/
+
+static void write_param(const char *path, int cpu)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f || fprintf(f, "%d\n", cpu) < 0 || fclose(f)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* @return arg with every %u and %k replaced, malloc()ed */
+static char *subst(const char *arg, int user_cpu, int kernel_cpu)
+{
+	size_t len = strlen(arg) * 4 + 1, n = 0;
+	char *out = malloc(len);
+
+	assert(out);
+	for (; *arg; arg++) {
+		if (arg[0] == '%' && (arg[1] == 'u' || arg[1] == 'k')) {
+			n += snprintf(out + n, len - n, "%d", arg[1] == 'u' ? user_cpu : kernel_cpu);
+			arg++;
+		} else {
+			out[n++] = *arg;
+		}
+	}
+	out[n] = '\0';
+	return out;
+}
+
+/* @return the exit status of the command */
+static int run(char **cmd, int user_cpu, int kernel_cpu)
+{
+	cpu_set_t set;
+	char **argv;
+	pid_t pid;
+	int i, n, status;
+
+	fflush(stdout);
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		CPU_ZERO(&set);
+		CPU_SET(user_cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			perror("sched_setaffinity");
+			_exit(EXIT_FAILURE);
+		}
+		for (n = 0; cmd[n]; n++)
+			;
+		argv = calloc(n + 1, sizeof(*argv));
+		assert(argv);
+		for (i = 0; i < n; i++)
+			argv[i] = subst(cmd[i], user_cpu, kernel_cpu);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char **argv)
+{
+	static struct cpu_topology cpus[TOPOLOGY_MAX_CPUS];
+	const char *param = NULL;
+	struct timespec settle = { 0, 0 };
+	int opt, n, user_cpu, kernel_cpu, status, failed = 0;
+	enum placement place;
+
+	while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			param = optarg;
+			break;
+		case 's':
+			settle.tv_sec = atoi(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind >= argc)
+		goto usage;
+	n = topology_read(cpus, TOPOLOGY_MAX_CPUS);
+	if (n <= 0) {
+		perror("topology_read");
+		return EXIT_FAILURE;
+	}
+
+	for (place = 0; place < PLACE_NR; place++) {
+		if (topology_pair(cpus, n, place, &user_cpu, &kernel_cpu)) {
+			printf("== %s: no such CPU pair here\n", placement_names[place]);
+			continue;
+		}
+		printf("== %s: user cpu %d, kernel cpu %d\n", placement_names[place],
+				user_cpu, kernel_cpu);
+		if (param) {
+			write_param(param, kernel_cpu);
+			nanosleep(&settle, NULL);
+		}
+		status = run(argv + optind, user_cpu, kernel_cpu);
+		if (status) {
+			printf("== %s: exit status %d\n", placement_names[place], status);
+			failed = 1;
+		}
+	}
+	if (param)
+		write_param(param, -1);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	printf("Usage: %s [-p kernel_cpu_param] [-s settle_seconds] command [args, %%u and %%k for the CPUs]\n",
+			argv[0]);
+	return EXIT_FAILURE;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE         // CPU_SET //
 #include <stdlib.h>         // exit //
 #include <sys/types.h>      // key_t //
 #include <sys/ipc.h>        // IPC_CREATE, ftok //
@@ -6,6 +7,13 @@
 #include <stdio.h>          // printf //
 #include <string.h>         // strcpy //
 #include <stdint.h>         // uint64_t //
+#include <sched.h>          // sched_yield //
+#include <time.h>           // clock_gettime //
+
+#include "shm_layout.h"     // struct shm_ring //
+
+#include "../mmap-module/perf-counters.h" // perf_counters_open, ... //
+#include "../mmap-module/rt.h"            // rt_setup //
 
 // #include "shm_bkm.h"
 
@@ -34,6 +42,7 @@ void disconnect (void *shm);
 int getSEM(void);
 int getSHM(void);
 long double handleKernelTiming( void *shm );
+long double burst( void *shm, int shmid, uint64_t messages, uint64_t depth );
 
 /**
  * Send message to server and perform benchmark.
@@ -49,6 +58,7 @@ long double benchmark (void *shm, int semid ){
     long double user_cycles;
     uint64_t difference;
     struct sembuf sb = {0,0,0};
+    struct perf_counters pc;
     user_cycles = 0.0;
 
     sb.sem_op = -1; // Lock sem 0 //
@@ -69,6 +79,8 @@ long double benchmark (void *shm, int semid ){
     // difference = stop - start;
 
     printf( "CLIENT : Initial Start Up: %llu\n", difference );
+    perf_counters_open( &pc );
+    perf_counters_start( &pc );
     for( i = 0; i < TRIALS; i++){
         strncpy( msg, "*How is the weather?", BUFSIZ );
 
@@ -85,6 +97,9 @@ long double benchmark (void *shm, int semid ){
 
         user_cycles = user_cycles + difference;
     }
+    perf_counters_stop( &pc );
+    perf_counters_print( &pc, "CLIENT : send", TRIALS );
+    perf_counters_close( &pc );
 
     /**
     * Notice we have left an asterisk in first byte
@@ -161,6 +176,67 @@ int getSHM()
     return shmid;
 }
 
+/**
+ * Post messages through the ring at the end of the segment, keeping up to
+ * depth of them in flight, and wait for every reply. The server drains
+ * all the posted messages each time it wakes up.
+ *
+ * @param shm      The attached segment.
+ * @param shmid    The shared memory handle.
+ * @param messages The number of messages.
+ * @param depth    The messages in flight, at most SHM_SLOTS.
+ * @return         The nanoseconds per message.
+ */
+long double burst( void *shm, int shmid, uint64_t messages, uint64_t depth ){
+    struct shmid_ds ds;
+    struct shm_ring *ring;
+    struct shm_slot *slot;
+    struct timespec start;
+    struct timespec stop;
+    uint64_t posted;
+    uint64_t answered;
+
+    if ( shmctl( shmid, IPC_STAT, &ds ) == -1 ){
+        perror( "shmctl" );
+        exit( -1 );
+    }
+    if ( ds.shm_segsz < 2 * sizeof( struct shm_ring ) ){
+        fprintf( stderr, "CLIENT : Segment too small for the ring\n" );
+        exit( -1 );
+    }
+    if ( depth < 1 || depth > SHM_SLOTS )
+        depth = SHM_SLOTS;
+    ring = shm + shm_ring_offset( ds.shm_segsz );
+
+    // Start over at message 0 //
+    memset( ring->slots, 0, sizeof( ring->slots ) );
+    ring->magic = SHM_LAYOUT_MAGIC;
+    shm_store_release( &ring->epoch, ring->epoch + 1 );
+
+    posted = 0;
+    answered = 0;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    while ( answered < messages ){
+        while ( posted < messages && posted - answered < depth ){
+            slot = &ring->slots[posted % SHM_SLOTS];
+            snprintf( slot->data, sizeof( slot->data ), "*Message %llu",
+                      (unsigned long long)posted );
+            slot->len = strlen( slot->data ) + 1;
+            shm_store_release( &slot->seq, 2 * posted + 1 );
+            posted++;
+        }
+        slot = &ring->slots[answered % SHM_SLOTS];
+        if ( shm_load_acquire( &slot->seq ) == 2 * answered + 2 )
+            answered++;
+        else
+            sched_yield();
+    }
+    clock_gettime( CLOCK_MONOTONIC, &stop );
+
+    return ( ( stop.tv_sec - start.tv_sec ) * 1e9L +
+             ( stop.tv_nsec - start.tv_nsec ) ) / (long double)messages;
+}
+
 long double handleKernelTiming( void *shm ){
     uint64_t kernel_cycles;
 
@@ -190,14 +266,36 @@ int main( int argc, char  *argv[] ){
     long double kernel_cycles;
     long double kernel_usecs;
 
+    // RT_CPU and RT_PRIO, before anything is timed //
+    if ( rt_setup() )
+        exit( -1 );
     shmid = getSHM();
     semid = getSEM();
     shm = connect( shmid );
 
+    // client burst [messages [depth]] //
+    if ( argc > 1 && strcmp( argv[1], "burst" ) == 0 ){
+        uint64_t messages = argc > 2 ? strtoull( argv[2], NULL, 0 ) : 100000;
+        uint64_t depth = argc > 3 ? strtoull( argv[3], NULL, 0 ) : SHM_SLOTS;
+
+        if ( messages < 1 )
+            messages = 1;
+        printf( "CLIENT : Ring burst of %llu messages\n",
+                (unsigned long long)messages );
+        printf( "CLIENT : Nanoseconds per message: %Lf\n",
+                burst( shm, shmid, messages, depth ) );
+        disconnect( shm );
+        return 0;
+    }
+
     user_cycles = 0.0;
     kernel_cycles = 0.0;
-    // user_cycles = benchmark( shm, semid );
-    // kernel_cycles = handleKernelTiming( shm );
+    // client session: one TRIALS session against the server, with the //
+    // hardware counters of the sends //
+    if ( argc > 1 && strcmp( argv[1], "session" ) == 0 ){
+        user_cycles = benchmark( shm, semid );
+        kernel_cycles = handleKernelTiming( shm );
+    }
 
     user_usecs = user_cycles / PROCESSOR_MHZ;
     kernel_usecs = kernel_cycles / PROCESSOR_MHZ;
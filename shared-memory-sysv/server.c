@@ -20,7 +20,27 @@
 #include <linux/types.h>    // uint64_t //
 #include <linux/syscalls.h> // sys_shmget //
 #include <linux/kthread.h>  // kthread_run, kthread_stop //
+#include <linux/cpumask.h>  // cpumask_of, cpu_online //
+#include <linux/sched.h>    // set_cpus_allowed_ptr //
+#include <linux/sched/isolation.h> // housekeeping_cpu //
+#include <linux/version.h>  // LINUX_VERSION_CODE //
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+#include <uapi/linux/sched/types.h> // struct sched_param //
+#endif
 #include <linux/delay.h>    // msleep_interruptible //
+#include <linux/ktime.h>    // ktime_get_ns //
+#include <linux/mm.h>       // kvzalloc, kvfree //
+#include <linux/string.h>   // memcpy_flushcache //
+#include <linux/timex.h>    // get_cycles //
+#include <linux/log2.h>     // ilog2 //
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h> // boot_cpu_has //
+#include <asm/fpu/api.h>    // kernel_fpu_begin, kernel_fpu_end //
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "shm_trace.h"      // trace_shm_message_handled //
+#include "shm_layout.h"     // struct shm_ring //
 
 // #include "shm_bmk.h"
 
@@ -28,6 +48,76 @@
 #define TRIALS    5000
 #define BUFSIZ    800
 #define KEY       9876
+#define MESSAGE   "~Thanks for the message Client"
+// Below this size the FPU save/restore costs more than SIMD saves //
+#define SIMD_MIN_BYTES    512
+// A new inter-arrival time weighs 1 / 2^GAP_SHIFT in the average //
+#define GAP_SHIFT         3
+// server_cpu asking for an isolated CPU //
+#define CPU_ISOLATED      -2
+// Bucket i counts the wakeups that drained 2^i to 2^(i+1)-1 messages //
+#define BATCH_BUCKETS     10
+
+// How handle_message() puts each message into shm //
+enum copy_mode {
+    COPY_INPLACE,   // strncpy the text straight into shm //
+    COPY_MEMCPY,    // memcpy a prebuilt payload //
+    COPY_SIMD,      // same, with SSE2/AVX2 between kernel_fpu_begin/end //
+    COPY_NT,        // same, with non-temporal stores //
+};
+
+static const char *copy_mode_names[] = {
+    [COPY_INPLACE] = "inplace",
+    [COPY_MEMCPY]  = "memcpy",
+    [COPY_SIMD]    = "simd",
+    [COPY_NT]      = "nt",
+};
+
+static char copy_mode[16] = "inplace";
+module_param_string( copy_mode, copy_mode, sizeof( copy_mode ), 0644 );
+MODULE_PARM_DESC( copy_mode, "inplace, memcpy, simd or nt" );
+
+static unsigned int shm_size = 1 << 20;
+module_param( shm_size, uint, 0444 );
+MODULE_PARM_DESC( shm_size, "Size of the shared memory segment in bytes" );
+
+static unsigned int msg_size = BUFSIZ;
+module_param( msg_size, uint, 0444 );
+MODULE_PARM_DESC( msg_size, "Size of each server message in bytes" );
+
+static int server_cpu = -1;
+module_param( server_cpu, int, 0644 );
+MODULE_PARM_DESC( server_cpu, "CPU of the server thread, -1 for any, "
+                  "-2 for the first isolated one, applied at its next poll" );
+
+static int server_prio = 0;
+module_param( server_prio, int, 0644 );
+MODULE_PARM_DESC( server_prio, "SCHED_FIFO priority of the server thread, "
+                  "0 for SCHED_NORMAL, applied at its next poll" );
+
+static unsigned int poll_us = 0;
+module_param( poll_us, uint, 0644 );
+MODULE_PARM_DESC( poll_us, "Busy poll budget after each message in "
+                  "microseconds, 0 to only sleep" );
+
+static bool poll_adaptive = true;
+module_param( poll_adaptive, bool, 0644 );
+MODULE_PARM_DESC( poll_adaptive, "Fit the budget to the inter-arrival "
+                  "times, up to poll_us" );
+
+static unsigned int sleep_ms = 1000;
+module_param( sleep_ms, uint, 0644 );
+MODULE_PARM_DESC( sleep_ms, "Sleep between polls once the budget is spent" );
+
+static unsigned long poll_budget_ns;
+module_param( poll_budget_ns, ulong, 0444 );
+MODULE_PARM_DESC( poll_budget_ns, "Budget after the last message" );
+
+static unsigned long batch_hist[BATCH_BUCKETS];
+static int batch_hist_nr = BATCH_BUCKETS;
+module_param_array( batch_hist, ulong, &batch_hist_nr, 0444 );
+MODULE_PARM_DESC( batch_hist, "Wakeups by messages drained, bucket i "
+                  "for 2^i to 2^(i+1)-1" );
 
 // External declarations //
 extern long k_shmat( int shmid );
@@ -35,17 +125,37 @@ extern long k_semop( int semid, struct sembuf *tsops,
                         unsigned int nsops );
 
 
+// Busy poll state of the server thread //
+struct poll_state {
+    u64 last_ns;    // Arrival of the previous message //
+    u64 gap_ns;     // Moving average of the inter-arrival times //
+    u64 polled;     // Messages found while polling //
+    u64 slept;      // Messages found after a sleep //
+};
+
 // Function prototypes //
 static void handle_message( void );
 static int message_ready( void );
 static int run_thread( void *data );
 static void send_kernel_timing( uint64_t cycles );
+static void copy_message( void *dst, enum copy_mode mode, size_t len );
+static struct shm_slot *ring_peek( void );
+static unsigned int drain_ring( enum copy_mode mode );
+static void print_batch_hist( void );
+static int apply_server_cpu( int cpu );
+static int apply_server_prio( int prio );
+static int isolated_cpu( void );
+static u64 update_poll_budget( struct poll_state *ps, u64 now );
 
 // Global variables //
 static struct task_struct *shm_task = NULL;
 static void *shm                    = NULL;
+static void *payload                = NULL;
 static int shmid;
 static int semid;
+static struct shm_ring *ring        = NULL;
+static uint32_t ring_epoch;
+static uint64_t ring_next;         // Next message expected in the ring //
 
 
 /**
@@ -62,19 +172,201 @@ __inline__ uint64_t bmk_rdtsc( void )
 
 
 /**
-* Called each time a client wishes to benchmark.
+* Parse the copy_mode parameter.
+*
+* @return The selected mode, COPY_INPLACE if unknown.
+*/
+static enum copy_mode get_copy_mode( void )
+{
+    int i;
+
+    for( i = 0; i < ARRAY_SIZE( copy_mode_names ); i++ )
+    {
+        if( sysfs_streq( copy_mode, copy_mode_names[i] ) )
+        {
+            return i;
+        }
+    }
+    return COPY_INPLACE;
+}
+
+/**
+* Copy with SIMD registers, saving the user FPU state around it.
+*
+* @param dst Destination.
+* @param src Source.
+* @param len Number of bytes.
+*/
+static void copy_simd( void *dst, const void *src, size_t len )
+{
+    size_t i = 0;
+
+#ifdef CONFIG_X86
+    if( len >= SIMD_MIN_BYTES && irq_fpu_usable() )
+    {
+        kernel_fpu_begin();
+        if( boot_cpu_has( X86_FEATURE_AVX2 ) )
+        {
+            for( ; i + 32 <= len; i += 32 )
+            {
+                asm volatile( "vmovdqu (%0), %%ymm0\n\t"
+                              "vmovdqu %%ymm0, (%1)\n\t"
+                              : : "r" ( src + i ), "r" ( dst + i ) : "memory" );
+            }
+            asm volatile( "vzeroupper" );
+        }
+        else
+        {
+            for( ; i + 16 <= len; i += 16 )
+            {
+                asm volatile( "movdqu (%0), %%xmm0\n\t"
+                              "movdqu %%xmm0, (%1)\n\t"
+                              : : "r" ( src + i ), "r" ( dst + i ) : "memory" );
+            }
+        }
+        kernel_fpu_end();
+    }
+#endif
+    memcpy( dst + i, src + i, len - i );
+}
+
+/**
+* Copy with stores that bypass the cache.
+*
+* @param dst Destination.
+* @param src Source.
+* @param len Number of bytes.
+*/
+static void copy_nt( void *dst, const void *src, size_t len )
+{
+#ifdef CONFIG_ARCH_HAS_UACCESS_FLUSHCACHE
+    memcpy_flushcache( dst, src, len );
+    wmb(); // Order the weakly ordered stores //
+#else
+    memcpy( dst, src, len );
+#endif
+}
+
+/**
+* Put one message into shm, without staging it on the stack.
+*
+* @param dst  Where in shm.
+* @param mode How to write it.
+* @param len  Number of bytes, at most msg_size.
+*/
+static void copy_message( void *dst, enum copy_mode mode, size_t len )
+{
+    switch( mode )
+    {
+    case COPY_INPLACE:
+        strncpy( dst, MESSAGE, len );
+        break;
+    case COPY_MEMCPY:
+        memcpy( dst, payload, len );
+        break;
+    case COPY_SIMD:
+        copy_simd( dst, payload, len );
+        break;
+    case COPY_NT:
+        copy_nt( dst, payload, len );
+        break;
+    }
+}
+
+/**
+* Check the ring for the next message, following a client that started
+* over.
+*
+* @return The slot of the next message if it is posted, NULL otherwise.
+*/
+static struct shm_slot *ring_peek( void )
+{
+    struct shm_slot *slot;
+    uint32_t epoch;
+
+    if( READ_ONCE( ring->magic ) != SHM_LAYOUT_MAGIC )
+    {
+        return NULL;
+    }
+    epoch = shm_load_acquire( &ring->epoch );
+    if( epoch != ring_epoch )
+    {
+        ring_epoch = epoch;
+        ring_next = 0;
+    }
+    slot = &ring->slots[ring_next % SHM_SLOTS];
+    if( shm_load_acquire( &slot->seq ) != 2 * ring_next + 1 )
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+/**
+* Reply in place to every message posted in the ring, including those
+* posted while draining.
+*
+* @param mode How to write the replies.
+* @return     The number of messages answered.
+*/
+static unsigned int drain_ring( enum copy_mode mode )
+{
+    struct shm_slot *slot;
+    unsigned int n = 0;
+    size_t len = min_t( size_t, msg_size, sizeof( slot->data ) );
+
+    while( ( slot = ring_peek() ) != NULL )
+    {
+        copy_message( slot->data, mode, len );
+        slot->len = len;
+        shm_store_release( &slot->seq, 2 * ring_next + 2 );
+        ring_next++;
+        n++;
+    }
+    return n;
+}
+
+/**
+* Print the wakeups by number of messages drained.
+*/
+static void print_batch_hist( void )
+{
+    int i;
+
+    for( i = 0; i < BATCH_BUCKETS; i++ )
+    {
+        if( batch_hist[i] )
+        {
+            printk( KERN_INFO "SERVER : %lu wakeups drained %u to %u "
+                    "messages\n", batch_hist[i], 1U << i,
+                    i == BATCH_BUCKETS - 1 ? UINT_MAX : ( 2U << i ) - 1 );
+        }
+    }
+}
+
+/**
+* Called each time the server finds work: a client wishing to benchmark,
+* messages in the ring, or both. Everything pending is handled under a
+* single lock of sem 0.
 */
 static void handle_message( void )
 {
     int i;
-    char msg[BUFSIZ];
+    int session;
+    unsigned int batch;
     uint64_t kernel_cycles;
-    // uint64_t start;
-    // uint64_t stop;
-    // uint64_t difference;
+    u64 session_start = 0;
+    cycles_t start;
+    enum copy_mode mode;
     struct sembuf sb = {0, 0, 0};
 
     kernel_cycles = 0;
+    mode = get_copy_mode();
+    // Only read the clock for the tracepoint when it is on //
+    if( trace_shm_message_handled_enabled() )
+    {
+        session_start = ktime_get_ns();
+    }
     sb.sem_op = -1; // Lock sem 0 //
     if( k_semop( semid, &sb, 1 ) == -1 )
     {
@@ -82,30 +374,46 @@ static void handle_message( void )
         return;
     }
 
-    for( i = 0; i < TRIALS; i++ )
+    session = strncmp( shm, "*", sizeof( char ) ) == 0;
+    if( session )
     {
-        strncpy( msg, "~Thanks for the message Client", BUFSIZ );
-        //printk( KERN_INFO "SERVER : Sending message: %s\n",
-        // msg );
-        // start = bmk_rdtsc();
-        memcpy( shm, msg, BUFSIZ );
-        // stop = bmk_rdtsc();
-        // difference = stop - start;
-        //printk( KERN_INFO "SERVER : Number of cycles: %llu\n",
-        //difference );
-        // kernel_cycles = kernel_cycles + difference;
+        start = get_cycles();
+        for( i = 0; i < TRIALS; i++ )
+        {
+            copy_message( shm, mode, msg_size );
+        }
+        kernel_cycles = get_cycles() - start;
+
+        if( kernel_cycles )
+        {
+            uint64_t milli = (uint64_t)msg_size * TRIALS * 1000 /
+                             kernel_cycles;
+
+            printk( KERN_INFO "SERVER : %s: %u bytes x %d in %llu cycles, "
+                    "%llu.%03llu bytes/cycle\n", copy_mode_names[mode],
+                    msg_size, TRIALS, kernel_cycles, milli / 1000,
+                    milli % 1000 );
+        }
+        send_kernel_timing( kernel_cycles );
     }
+    batch = session + drain_ring( mode );
 
-    // printk( KERN_INFO "SERVER : Total cycles: %llu\n",
-    //         kernel_cycles );
-    send_kernel_timing( 52 );
-    // send_kernel_timing( kernel_cycles );
     sb.sem_op = 1; // Free sem 0 //
     if( k_semop( semid, &sb, 1 ) == -1 )
     {
         printk( KERN_INFO "SERVER : Unable to free sem 0\n" );
         return;
     }
+    if( batch )
+    {
+        batch_hist[min( ilog2( batch ), BATCH_BUCKETS - 1 )]++;
+    }
+    // session_start stays 0 if the tracepoint was enabled meanwhile //
+    if( session && session_start )
+    {
+        trace_shm_message_handled( TRIALS, msg_size,
+                                   ktime_get_ns() - session_start );
+    }
 }
 
 /**
@@ -119,7 +427,170 @@ static int message_ready( void )
     {
         return true;
     }
-    return false;
+    return ring_peek() != NULL;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define SHM_HK_DOMAIN     HK_TYPE_DOMAIN
+#define SHM_HK_TICK       HK_TYPE_TICK
+#else
+#define SHM_HK_DOMAIN     HK_FLAG_DOMAIN
+#define SHM_HK_TICK       HK_FLAG_TICK
+#endif
+
+/**
+* Find a CPU taken out of the scheduler domains (isolcpus=) or of the
+* tick (nohz_full=).
+*
+* @return The first online one, -1 if there is none.
+*/
+static int isolated_cpu( void )
+{
+    int cpu;
+
+    for_each_online_cpu( cpu )
+    {
+        if( !housekeeping_cpu( cpu, SHM_HK_DOMAIN ) ||
+            !housekeeping_cpu( cpu, SHM_HK_TICK ) )
+        {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/**
+* Move the server thread to the CPU asked for by server_cpu.
+*
+* @param cpu The server_cpu value applied last.
+* @return    The value applied now.
+*/
+static int apply_server_cpu( int cpu )
+{
+    int want = READ_ONCE( server_cpu );
+    int result;
+
+    if( want == cpu )
+    {
+        return cpu;
+    }
+    if( want == CPU_ISOLATED )
+    {
+        result = isolated_cpu();
+        if( result < 0 )
+        {
+            printk( KERN_INFO "SERVER : No isolated CPU\n" );
+            return want;
+        }
+        printk( KERN_INFO "SERVER : Moving to isolated CPU %d\n", result );
+        result = set_cpus_allowed_ptr( current, cpumask_of( result ) );
+    }
+    else if( want < 0 )
+    {
+        result = set_cpus_allowed_ptr( current, cpu_possible_mask );
+    }
+    else if( want < nr_cpu_ids && cpu_online( want ) )
+    {
+        result = set_cpus_allowed_ptr( current, cpumask_of( want ) );
+    }
+    else
+    {
+        result = -EINVAL;
+    }
+    if( result )
+    {
+        printk( KERN_INFO "SERVER : Unable to move to CPU %d: %d\n",
+                want, result );
+    }
+    return want;
+}
+
+/**
+* Switch the server thread to the scheduling policy asked for by
+* server_prio: SCHED_FIFO at that priority, SCHED_NORMAL for 0. Since
+* 5.9 modules only get the lowest FIFO priority, for 1, or the default
+* one, MAX_RT_PRIO / 2, for any other.
+*
+* @param prio The server_prio value applied last.
+* @return     The value applied now.
+*/
+static int apply_server_prio( int prio )
+{
+    int want = READ_ONCE( server_prio );
+    int result = 0;
+
+    if( want == prio )
+    {
+        return prio;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+    if( want <= 0 )
+    {
+        sched_set_normal( current, 0 );
+    }
+    else if( want == 1 )
+    {
+        sched_set_fifo_low( current );
+    }
+    else
+    {
+        sched_set_fifo( current );
+    }
+#else
+    {
+        struct sched_param sp = {
+            .sched_priority = clamp( want, 0, MAX_RT_PRIO - 1 )
+        };
+
+        result = sched_setscheduler_nocheck( current, want > 0 ?
+                                             SCHED_FIFO : SCHED_NORMAL,
+                                             &sp );
+    }
+#endif
+    if( result )
+    {
+        printk( KERN_INFO "SERVER : Unable to set priority %d: %d\n",
+                want, result );
+    }
+    return want;
+}
+
+/**
+* Account a message arrived at now and choose how long to busy poll for
+* the next one. Adaptive: through twice the average gap when it fits in
+* poll_us, else only a short probe, so that sparse traffic does not burn
+* the CPU but a burst is still noticed.
+*
+* @param ps  The poll state of the thread.
+* @param now The arrival time in nanoseconds.
+* @return    The budget in nanoseconds.
+*/
+static u64 update_poll_budget( struct poll_state *ps, u64 now )
+{
+    u64 max = (u64)READ_ONCE( poll_us ) * NSEC_PER_USEC;
+    u64 budget = max;
+    u64 gap;
+
+    if( ps->last_ns )
+    {
+        gap = now - ps->last_ns;
+        if( ps->gap_ns )
+        {
+            ps->gap_ns = ps->gap_ns - ( ps->gap_ns >> GAP_SHIFT ) +
+                         ( gap >> GAP_SHIFT );
+        }
+        else
+        {
+            ps->gap_ns = gap;
+        }
+    }
+    ps->last_ns = now;
+    if( READ_ONCE( poll_adaptive ) && ps->gap_ns )
+    {
+        budget = ps->gap_ns <= max ? min( max, 2 * ps->gap_ns ) : max / 8;
+    }
+    WRITE_ONCE( poll_budget_ns, budget );
+    return budget;
 }
 
 /**
@@ -133,6 +604,11 @@ static int run_thread(void *data)
 {
     // union semun arg;
     unsigned long arg = 1;
+    int cpu = -1;
+    int prio = 0;
+    struct poll_state ps = { 0 };
+    u64 poll_until = 0;
+    u64 now;
 
     semid = sys_semget( KEY, 1, 066 | IPC_CREAT );
 
@@ -151,7 +627,21 @@ static int run_thread(void *data)
         "SERVER : Unable to initialize sem 0\n" );
         return -1;
     }
-    shmid = sys_shmget( KEY, BUFSIZ, 0666 | IPC_CREAT );
+    // The ring takes the end of the segment, the session the rest //
+    shm_size = max_t( unsigned int, shm_size,
+                      2 * sizeof( struct shm_ring ) );
+    // The timing is sent after the message, at byte 1 //
+    msg_size = clamp_t( unsigned int, msg_size, 1 + sizeof( uint64_t ),
+                        shm_ring_offset( shm_size ) );
+    payload = kvzalloc( msg_size, GFP_KERNEL );
+    if( !payload )
+    {
+        printk( KERN_INFO "SERVER : Unable to allocate the payload\n" );
+        return -1;
+    }
+    strncpy( payload, MESSAGE, msg_size );
+
+    shmid = sys_shmget( KEY, shm_size, 0666 | IPC_CREAT );
 
     if( shmid < 0 )
     {
@@ -168,17 +658,41 @@ static int run_thread(void *data)
         return -1;
     }
     strncpy( shm, "~", sizeof( char ) );
+    ring = shm + shm_ring_offset( shm_size );
 
     while( !kthread_should_stop() )
     {
+        cpu = apply_server_cpu( cpu );
+        prio = apply_server_prio( prio );
         if( message_ready() )
         {
-            printk( KERN_INFO "SERVER : Message ready\n" );
+            now = ktime_get_ns();
+            if( now < poll_until )
+            {
+                ps.polled++;
+            }
+            else
+            {
+                ps.slept++;
+            }
+            // A console printk would cost more than the poll saves //
+            pr_debug( "SERVER : Message ready\n" );
             handle_message();
+            poll_until = ktime_get_ns() + update_poll_budget( &ps, now );
+            continue;
+        }
+        if( ktime_get_ns() < poll_until )
+        {
+            cpu_relax();
+            cond_resched();
+            continue;
         }
         // ssleep(1000);
-        msleep_interruptible( 1000 );    // interruptible sleep, i guess
+        msleep_interruptible( READ_ONCE( sleep_ms ) );    // interruptible sleep, i guess
     }
+    printk( KERN_INFO "SERVER : %llu messages found polling, %llu after "
+            "sleeping\n", ps.polled, ps.slept );
+    print_batch_hist();
     return 0;
 }
 
@@ -233,6 +747,7 @@ void cleanup_module()
         printk( KERN_INFO
         "SERVER : Unable to remove semaphore\n" );
     }
+    kvfree( payload );
 }
 
 // module_init(init_module);
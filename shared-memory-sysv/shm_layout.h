@@ -0,0 +1,59 @@
+#ifndef SHM_LAYOUT_H
+#define SHM_LAYOUT_H
+
+/**
+ * Layout of the shared segment, shared by server.c and client.c.
+ *
+ * The start of the segment keeps the single session protocol: a '*' at
+ * byte 0 asks for a session, the server answers with its messages and puts
+ * '~' and its timing at bytes 0 and 1.
+ *
+ * The end of the segment holds a ring of SHM_SLOTS message slots. Message m
+ * goes to slot m % SHM_SLOTS: the client writes it and publishes it by
+ * storing 2m + 1 in seq, the server replies in place and stores 2m + 2.
+ * The server drains every published slot each time it wakes up. A client
+ * starting over at message 0 bumps epoch first.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>    // uint32_t, uint64_t //
+#include <asm/barrier.h>    // smp_load_acquire, smp_store_release //
+#else
+#include <stdint.h>         // uint32_t, uint64_t //
+#endif
+
+#define SHM_LAYOUT_MAGIC    0x676e6972 // "ring" //
+#define SHM_SLOTS           64
+#define SHM_SLOT_SIZE       256
+#define SHM_CACHELINE       64
+
+struct shm_slot {
+    uint64_t seq;
+    uint32_t len;       // Of the message, then of the reply //
+    uint32_t reserved;
+    char data[SHM_SLOT_SIZE - 16];
+} __attribute__(( aligned( SHM_CACHELINE ) ));
+
+struct shm_ring {
+    uint32_t magic;     // SHM_LAYOUT_MAGIC once a client set it up //
+    uint32_t epoch;
+    struct shm_slot slots[SHM_SLOTS];
+};
+
+#ifdef __KERNEL__
+#define shm_load_acquire( p )       smp_load_acquire( p )
+#define shm_store_release( p, v )   smp_store_release( p, v )
+#else
+#define shm_load_acquire( p )       __atomic_load_n( p, __ATOMIC_ACQUIRE )
+#define shm_store_release( p, v )   __atomic_store_n( p, v, __ATOMIC_RELEASE )
+#endif
+
+/**
+ * Offset of the ring in a segment of shm_size bytes.
+ */
+static inline unsigned long shm_ring_offset( unsigned long shm_size )
+{
+    return ( shm_size - sizeof( struct shm_ring ) ) & ~( SHM_CACHELINE - 1UL );
+}
+
+#endif
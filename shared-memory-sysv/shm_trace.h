@@ -0,0 +1,48 @@
+/**
+* @file shm_trace.h
+* @brief Tracepoints of the shared memory benchmark server.
+*
+* Disabled tracepoints are a static branch and cost nothing. Enable with
+* echo 1 > /sys/kernel/debug/tracing/events/shm_server/enable
+* or attach with perf/bpftrace to tracepoint:shm_server:*.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM shm_server
+
+#if !defined(_SHM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SHM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/**
+* One client session handled by handle_message().
+*
+* @param messages Number of messages written to shm.
+* @param bytes    Size of each message.
+* @param ns       Time from taking to releasing sem 0.
+*/
+TRACE_EVENT( shm_message_handled,
+    TP_PROTO( unsigned int messages, unsigned int bytes, u64 ns ),
+    TP_ARGS( messages, bytes, ns ),
+    TP_STRUCT__entry(
+        __field( unsigned int, messages )
+        __field( unsigned int, bytes )
+        __field( u64, ns )
+    ),
+    TP_fast_assign(
+        __entry->messages = messages;
+        __entry->bytes = bytes;
+        __entry->ns = ns;
+    ),
+    TP_printk( "messages=%u bytes=%u ns=%llu",
+        __entry->messages, __entry->bytes,
+        (unsigned long long)__entry->ns )
+);
+
+#endif /* _SHM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE shm_trace
+#include <trace/define_trace.h>